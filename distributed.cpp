@@ -0,0 +1,431 @@
+#include "distributed.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <numeric>
+#include <random>
+
+#include "control_flow.h"
+
+namespace {
+
+// A single-producer single-consumer ring of reals. head and tail count the
+// reals written and read so far.
+struct channel_t {
+    std::atomic<std::uint64_t> head, tail;
+};
+
+// Start of a segment. dead marks a segment left over from an earlier job,
+// which rank 0 is about to replace. departed counts the ranks that are done
+// with the segment.
+struct header_t {
+    std::atomic<std::uint64_t> dead, departed;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "Shared memory channels need lock-free atomics");
+
+// The header is followed by world join and world go slots, used to check in
+// with rank 0, and then by the channels.
+std::size_t prefix_bytes(std::size_t world) {
+    return sizeof(header_t) + 2 * world * sizeof(std::atomic<std::uint64_t>);
+}
+
+std::size_t channel_bytes(std::size_t capacity) {
+    return sizeof(channel_t) + capacity * sizeof(real);
+}
+
+header_t* get_header(void* segment) { return (header_t*)segment; }
+
+std::atomic<std::uint64_t>* join_slots(void* segment) {
+    return (std::atomic<std::uint64_t>*)(get_header(segment) + 1);
+}
+
+std::atomic<std::uint64_t>* go_slots(void* segment, std::size_t world) {
+    return join_slots(segment) + world;
+}
+
+channel_t* get_channel(void* segment, std::size_t world, std::size_t capacity,
+                       std::size_t i) {
+    return (channel_t*)((char*)segment + prefix_bytes(world) +
+                        i * channel_bytes(capacity));
+}
+
+real* channel_data(channel_t* channel) { return (real*)(channel + 1); }
+
+void* map_segment(int fd, std::size_t bytes, const std::string& name) {
+    auto segment =
+        mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED)
+        PANIC("Mapping shared memory {} failed: {}", name, strerror(errno));
+    return segment;
+}
+
+void backoff() { std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
+
+}  // namespace
+
+shm_transport::shm_transport(const std::string& name_, std::size_t rank_,
+                             std::size_t world_, std::size_t capacity_) {
+    name = name_;
+    rank = rank_;
+    world = world_;
+    capacity = capacity_;
+    bytes = prefix_bytes(world) + world * channel_bytes(capacity);
+    if (!rank) {
+        // A segment of a crashed job still holds its counters. Ranks that
+        // attached to it are told to look again, and a new, zero-filled
+        // segment takes its place.
+        auto fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd >= 0) {
+            struct stat st;
+            if (!fstat(fd, &st) &&
+                (std::size_t)st.st_size >= sizeof(header_t)) {
+                auto old = map_segment(fd, sizeof(header_t), name);
+                get_header(old)->dead.store(1, std::memory_order_release);
+                munmap(old, sizeof(header_t));
+            }
+            close(fd);
+            shm_unlink(name.c_str());
+        }
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) PANIC("shm_open {} failed: {}", name, strerror(errno));
+        if (ftruncate(fd, bytes))
+            PANIC("Resizing shared memory {} failed: {}", name,
+                  strerror(errno));
+        segment = map_segment(fd, bytes, name);
+        close(fd);
+        // Startup barrier: answer every other rank once it has checked in.
+        auto join = join_slots(segment), go = go_slots(segment, world);
+        for (std::size_t r = 1; r < world; r++) {
+            std::uint64_t nonce;
+            while (!(nonce = join[r].load(std::memory_order_acquire)))
+                backoff();
+            go[r].store(nonce, std::memory_order_release);
+        }
+        return;
+    }
+    std::random_device device;
+    std::uint64_t nonce = ((std::uint64_t)device() << 32 | device()) | 1;
+    while (true) {
+        // Only rank 0 creates the segment, so wait until it exists and is
+        // large enough.
+        auto fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            if (errno != ENOENT)
+                PANIC("shm_open {} failed: {}", name, strerror(errno));
+            backoff();
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) || (std::size_t)st.st_size < bytes) {
+            close(fd);
+            backoff();
+            continue;
+        }
+        segment = map_segment(fd, bytes, name);
+        close(fd);
+        join_slots(segment)[rank].store(nonce, std::memory_order_release);
+        auto& go = go_slots(segment, world)[rank];
+        auto header = get_header(segment);
+        while (go.load(std::memory_order_acquire) != nonce &&
+               !header->dead.load(std::memory_order_acquire))
+            backoff();
+        if (go.load(std::memory_order_acquire) == nonce) return;
+        munmap(segment, bytes);
+    }
+}
+
+shm_transport::~shm_transport() {
+    // Final barrier, after which rank 0 removes the name.
+    auto header = get_header(segment);
+    header->departed.fetch_add(1, std::memory_order_acq_rel);
+    if (!rank) {
+        while (header->departed.load(std::memory_order_acquire) < world)
+            backoff();
+        shm_unlink(name.c_str());
+    }
+    munmap(segment, bytes);
+}
+
+void shm_transport::exchange(const real* out, std::size_t out_size, real* in,
+                             std::size_t in_size) {
+    auto send = get_channel(segment, world, capacity, rank);
+    auto recv =
+        get_channel(segment, world, capacity, (rank + world - 1) % world);
+    std::size_t sent = 0, received = 0;
+    while (sent < out_size || received < in_size) {
+        bool progress = false;
+        if (sent < out_size) {
+            auto head = send->head.load(std::memory_order_relaxed);
+            auto tail = send->tail.load(std::memory_order_acquire);
+            auto n = std::min(out_size - sent, capacity - (head - tail));
+            for (std::size_t i = 0; i < n; i++)
+                channel_data(send)[(head + i) % capacity] = out[sent + i];
+            send->head.store(head + n, std::memory_order_release);
+            sent += n;
+            progress |= n > 0;
+        }
+        if (received < in_size) {
+            auto head = recv->head.load(std::memory_order_acquire);
+            auto tail = recv->tail.load(std::memory_order_relaxed);
+            auto n = std::min(in_size - received, (std::size_t)(head - tail));
+            for (std::size_t i = 0; i < n; i++)
+                in[received + i] = channel_data(recv)[(tail + i) % capacity];
+            recv->tail.store(tail + n, std::memory_order_release);
+            received += n;
+            progress |= n > 0;
+        }
+        if (!progress) std::this_thread::yield();
+    }
+}
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+tcp_transport::tcp_transport(const std::string& host, std::uint16_t base_port,
+                             std::size_t rank_, std::size_t world_) {
+    rank = rank_;
+    world = world_;
+    auto address = [&](std::size_t r) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(base_port + r);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+            PANIC("Invalid address {}", host);
+        return addr;
+    };
+    auto listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        PANIC("Rank {} cannot create a socket: {}", rank, strerror(errno));
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    auto self = address(rank);
+    if (bind(listen_fd, (sockaddr*)&self, sizeof(self)) || listen(listen_fd, 1))
+        PANIC("Rank {} cannot listen on port {}: {}", rank, base_port + rank,
+              strerror(errno));
+    // The next rank may not be listening yet.
+    auto next = address((rank + 1) % world);
+    while (true) {
+        next_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (next_fd < 0)
+            PANIC("Rank {} cannot create a socket: {}", rank, strerror(errno));
+        if (!connect(next_fd, (sockaddr*)&next, sizeof(next))) break;
+        close(next_fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    prev_fd = accept(listen_fd, nullptr, nullptr);
+    if (prev_fd < 0) PANIC("Rank {} failed to accept: {}", rank, strerror(errno));
+    close(listen_fd);
+    set_nonblocking(next_fd);
+    set_nonblocking(prev_fd);
+}
+
+tcp_transport::tcp_transport(int next_fd_, int prev_fd_, std::size_t rank_,
+                             std::size_t world_) {
+    next_fd = next_fd_;
+    prev_fd = prev_fd_;
+    rank = rank_;
+    world = world_;
+    set_nonblocking(next_fd);
+    set_nonblocking(prev_fd);
+}
+
+tcp_transport::~tcp_transport() {
+    close(next_fd);
+    if (prev_fd != next_fd) close(prev_fd);
+}
+
+void tcp_transport::exchange(const real* out, std::size_t out_size, real* in,
+                             std::size_t in_size) {
+    auto out_bytes = out_size * sizeof(real), in_bytes = in_size * sizeof(real);
+    std::size_t sent = 0, received = 0;
+    while (sent < out_bytes || received < in_bytes) {
+        pollfd fds[2];
+        nfds_t n = 0;
+        if (sent < out_bytes) fds[n++] = {next_fd, POLLOUT, 0};
+        if (received < in_bytes) fds[n++] = {prev_fd, POLLIN, 0};
+        if (poll(fds, n, -1) < 0 && errno != EINTR)
+            PANIC("Polling rank {}'s sockets failed: {}", rank, strerror(errno));
+        if (sent < out_bytes) {
+            auto k = ::send(next_fd, (const char*)out + sent, out_bytes - sent,
+                            MSG_NOSIGNAL);
+            if (k > 0) sent += k;
+            else if (k < 0 && errno != EAGAIN && errno != EINTR)
+                PANIC("Rank {} failed to send: {}", rank, strerror(errno));
+        }
+        if (received < in_bytes) {
+            auto k = ::recv(prev_fd, (char*)in + received, in_bytes - received, 0);
+            if (k > 0) received += k;
+            else if (!k) PANIC("Rank {} lost its previous rank", rank);
+            else if (errno != EAGAIN && errno != EINTR)
+                PANIC("Rank {} failed to receive: {}", rank, strerror(errno));
+        }
+    }
+}
+
+void ring_allreduce(transport_t* transport, real* data, std::size_t size) {
+    auto world = transport->world, rank = transport->rank;
+    if (world == 1) return;
+    auto begin = [&](std::size_t c) { return c * size / world; };
+    auto length = [&](std::size_t c) { return begin(c + 1) - begin(c); };
+    std::vector<real> buffer(length(0) + 1);
+    // After step s of the reduce-scatter, chunk rank - s - 1 holds the sum
+    // over ranks rank - s - 1 to rank.
+    for (std::size_t s = 0; s + 1 < world; s++) {
+        auto out = (rank + world - s) % world;
+        auto in = (rank + world - s - 1) % world;
+        transport->exchange(data + begin(out), length(out), buffer.data(),
+                            length(in));
+        for (std::size_t i = 0; i < length(in); i++)
+            data[begin(in) + i] += buffer[i];
+    }
+    // Chunk rank + 1 is now complete and goes round the ring.
+    for (std::size_t s = 0; s + 1 < world; s++) {
+        auto out = (rank + 1 + world - s) % world;
+        auto in = (rank + world - s) % world;
+        transport->exchange(data + begin(out), length(out), data + begin(in),
+                            length(in));
+    }
+}
+
+void ring_broadcast(transport_t* transport, real* data, std::size_t size) {
+    // Sums with zeros are exact.
+    if (transport->rank) std::fill(data, data + size, 0);
+    ring_allreduce(transport, data, size);
+}
+
+data_parallel::data_parallel(transport_t* transport_, graph_t* g,
+                             std::size_t bucket_size_) {
+    transport = transport_;
+    bucket_size = bucket_size_;
+    std::vector<node_t*> parameters;
+    for (auto u : g->nodes)
+        if (u->parameterp) parameters.push_back(u);
+    // The number of parameters, their total size and a sum of their sizes
+    // weighted by position, compared with those of rank 0.
+    std::vector<real> layout(3, 0);
+    for (std::size_t i = 0; i < parameters.size(); i++) {
+        auto size = shape_to_size(parameters[i]->value.shape);
+        layout[0]++;
+        layout[1] += size;
+        layout[2] += (i + 1) * size;
+    }
+    auto expected = layout;
+    ring_broadcast(transport, expected.data(), expected.size());
+    real mismatches = layout != expected;
+    ring_allreduce(transport, &mismatches, 1);
+    if (mismatches)
+        PANIC("Parameters of {} ranks do not match those of rank 0",
+              mismatches);
+    std::vector<real> buffer;
+    for (auto u : parameters)
+        buffer.insert(buffer.end(), u->value.data,
+                      u->value.data + shape_to_size(u->value.shape));
+    ring_broadcast(transport, buffer.data(), buffer.size());
+    auto p = buffer.data();
+    for (auto u : parameters) {
+        auto size = shape_to_size(u->value.shape);
+        std::copy(p, p + size, u->value.data);
+        p += size;
+    }
+    worker = std::thread([this] {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this] { return stop || !queue.empty(); });
+            if (queue.empty()) return;
+            auto nodes = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            reduce(nodes);
+            lock.lock();
+            pending--;
+            cv.notify_all();
+        }
+    });
+}
+
+data_parallel::~data_parallel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+void data_parallel::reduce(const std::vector<node_t*>& nodes) {
+    std::vector<real> buffer;
+    for (auto u : nodes)
+        buffer.insert(buffer.end(), u->acc.data,
+                      u->acc.data + shape_to_size(u->value.shape));
+    ring_allreduce(transport, buffer.data(), buffer.size());
+    auto p = buffer.data();
+    for (auto u : nodes) {
+        auto size = shape_to_size(u->value.shape);
+        std::copy(p, p + size, u->acc.data);
+        p += size;
+    }
+}
+
+void data_parallel::ready(node_t* u) {
+    bucket.push_back(u);
+    bucket_fill += shape_to_size(u->value.shape);
+    if (bucket_fill < bucket_size) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(bucket);
+        pending++;
+    }
+    cv.notify_all();
+    bucket.clear();
+    bucket_fill = 0;
+}
+
+std::size_t data_parallel::finish(std::size_t selected) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!bucket.empty()) {
+        queue.push_back(bucket);
+        pending++;
+        cv.notify_all();
+        bucket.clear();
+        bucket_fill = 0;
+    }
+    cv.wait(lock, [this] { return !pending; });
+    lock.unlock();
+    real total = selected;
+    ring_allreduce(transport, &total, 1);
+    return (std::size_t)total;
+}
+
+std::vector<std::size_t> data_parallel::sample(std::uint64_t seed,
+                                               std::size_t step, std::size_t n,
+                                               std::size_t batch_size) {
+    auto total = transport->world * batch_size;
+    if (total > n) PANIC("Minibatch of {} exceeds {} examples", total, n);
+    std::mt19937_64 rng(seed ^ (step * 0x9e3779b97f4a7c15ull));
+    std::vector<std::size_t> indices(n);
+    std::iota(indices.begin(), indices.end(), 0);
+    for (std::size_t i = 0; i < total; i++) {
+        std::uniform_int_distribution<std::size_t> dist(i, n - 1);
+        std::swap(indices[i], indices[dist(rng)]);
+    }
+    auto first = indices.begin() + transport->rank * batch_size;
+    return std::vector<std::size_t>(first, first + batch_size);
+}
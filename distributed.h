@@ -0,0 +1,91 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "graph.h"
+
+// Connects a rank to its neighbours on a ring of world processes.
+struct transport_t {
+    std::size_t rank, world;
+    virtual ~transport_t() = default;
+    // Sends out to rank + 1 while receiving in from rank - 1 (modulo world),
+    // returning when both are complete.
+    virtual void exchange(const real* out, std::size_t out_size, real* in,
+                          std::size_t in_size) = 0;
+};
+
+// Ring buffers in a POSIX shared memory segment, one per rank. All ranks of
+// a job must use the same name, and no other job may use it at the same time.
+// Rank 0 creates the segment, replacing one left by a crashed job, and the
+// constructor returns once every rank has attached to it; rank 0 removes it
+// once every rank has destroyed its transport.
+struct shm_transport : public transport_t {
+    std::string name;
+    std::size_t capacity, bytes;
+    void* segment;
+    shm_transport(const std::string& name_, std::size_t rank_,
+                  std::size_t world_, std::size_t capacity_ = 1 << 17);
+    virtual ~shm_transport();
+    virtual void exchange(const real* out, std::size_t out_size, real* in,
+                          std::size_t in_size) override;
+};
+
+// Stream sockets to the next and the previous rank. Rank r listens on
+// base_port + r of host; alternatively, already connected sockets can be
+// passed in.
+struct tcp_transport : public transport_t {
+    int next_fd, prev_fd;
+    tcp_transport(const std::string& host, std::uint16_t base_port,
+                  std::size_t rank_, std::size_t world_);
+    tcp_transport(int next_fd_, int prev_fd_, std::size_t rank_,
+                  std::size_t world_);
+    virtual ~tcp_transport();
+    virtual void exchange(const real* out, std::size_t out_size, real* in,
+                          std::size_t in_size) override;
+};
+
+// Replaces data on every rank with its sum over all ranks, using a ring
+// reduce-scatter followed by a ring all-gather, so every rank sends and
+// receives 2 (world - 1) / world times the data.
+void ring_allreduce(transport_t* transport, real* data, std::size_t size);
+
+// Replaces data on every rank with that of rank 0.
+void ring_broadcast(transport_t* transport, real* data, std::size_t size);
+
+// Sums the acc gradients of the parameters of identical graphs across ranks.
+// The constructor checks that the parameters of g have the same shapes on
+// every rank and gives them the values of rank 0. Parameters are handed over
+// as their gradients become final during the backward pass and reduced in
+// buckets on a background thread, overlapping communication with the rest of
+// the backward pass.
+struct data_parallel {
+    transport_t* transport;
+    std::size_t bucket_size;
+    std::vector<node_t*> bucket;
+    std::size_t bucket_fill = 0;
+    std::deque<std::vector<node_t*>> queue;
+    std::size_t pending = 0;
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread worker;
+    data_parallel(transport_t* transport_, graph_t* g,
+                  std::size_t bucket_size_ = 1 << 16);
+    ~data_parallel();
+    // The acc of parameter u holds this rank's final sum.
+    void ready(node_t* u);
+    // Waits for every gradient to be reduced and returns the total number
+    // of examples over all ranks, given this rank's.
+    std::size_t finish(std::size_t selected);
+    // This rank's share of a minibatch of world * batch_size distinct
+    // indices in [0, n), drawn identically on every rank from seed and step.
+    std::vector<std::size_t> sample(std::uint64_t seed, std::size_t step,
+                                    std::size_t n, std::size_t batch_size);
+    void reduce(const std::vector<node_t*>& nodes);
+};
@@ -0,0 +1,372 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <type_traits>
+
+#include "control_flow.h"
+#include "graph.h"
+#include "runtime.h"
+#include "simd_math.h"
+
+// Element-wise expressions over the values of several nodes of the same
+// shape, computed by one fused_node in a single pass over memory:
+//
+//     using namespace fused;
+//     auto y = fuse(relu(arg<0>() + arg<1>()) * 0.5, {a, b}, "y");
+//
+// arg<K> is the K-th input of fuse. Expressions are evaluated a block at a
+// time so that the transcendental functions run on the simd_math kernels.
+// The backward pass is derived from the expression type and recomputes
+// intermediate values instead of storing them.
+namespace fused {
+
+// Elements per block; temporaries of this size live on the stack.
+constexpr std::size_t block = 256;
+
+struct expr_t {};
+
+template <class E>
+constexpr bool is_expr = std::is_base_of<expr_t, E>::value;
+
+// An expression E provides
+//   arity: one more than the largest K of its arg<K> leaves
+//   cost: elementary operations per element, for the grain size
+//   eval(in, n, out): out[i] = E(in[0][i], in[1][i], ...) for i < n
+//   backward(in, n, g, grads): grads[K][i] += g[i] dE/d in[K][i]
+template <std::size_t K>
+struct arg : expr_t {
+    static constexpr std::size_t arity = K + 1, cost = 1;
+    void eval(const real* const* in, std::size_t n, real* out) const {
+        std::copy(in[K], in[K] + n, out);
+    }
+    void backward(const real* const* in, std::size_t n, const real* g,
+                  real* const* grads) const {
+        for (std::size_t i = 0; i < n; i++) grads[K][i] += g[i];
+    }
+};
+
+struct constant : expr_t {
+    static constexpr std::size_t arity = 0, cost = 1;
+    real c;
+    explicit constant(real c_) : c(c_) {}
+    void eval(const real* const* in, std::size_t n, real* out) const {
+        std::fill(out, out + n, c);
+    }
+    void backward(const real* const* in, std::size_t n, const real* g,
+                  real* const* grads) const {}
+};
+
+template <class A, class B>
+struct binary : expr_t {
+    static constexpr std::size_t arity = std::max(A::arity, B::arity),
+                                 cost = A::cost + B::cost + 1;
+    A a;
+    B b;
+    binary(const A& a_, const B& b_) : a(a_), b(b_) {}
+};
+
+template <class A, class B>
+struct sum : binary<A, B> {
+    using binary<A, B>::binary;
+    void eval(const real* const* in, std::size_t n, real* out) const {
+        real t[block] = {};
+        this->a.eval(in, n, out);
+        this->b.eval(in, n, t);
+        for (std::size_t i = 0; i < n; i++) out[i] += t[i];
+    }
+    void backward(const real* const* in, std::size_t n, const real* g,
+                  real* const* grads) const {
+        this->a.backward(in, n, g, grads);
+        this->b.backward(in, n, g, grads);
+    }
+};
+
+template <class A, class B>
+struct difference : binary<A, B> {
+    using binary<A, B>::binary;
+    void eval(const real* const* in, std::size_t n, real* out) const {
+        real t[block] = {};
+        this->a.eval(in, n, out);
+        this->b.eval(in, n, t);
+        for (std::size_t i = 0; i < n; i++) out[i] -= t[i];
+    }
+    void backward(const real* const* in, std::size_t n, const real* g,
+                  real* const* grads) const {
+        real t[block] = {};
+        this->a.backward(in, n, g, grads);
+        for (std::size_t i = 0; i < n; i++) t[i] = -g[i];
+        this->b.backward(in, n, t, grads);
+    }
+};
+
+template <class A, class B>
+struct product : binary<A, B> {
+    using binary<A, B>::binary;
+    void eval(const real* const* in, std::size_t n, real* out) const {
+        real t[block] = {};
+        this->a.eval(in, n, out);
+        this->b.eval(in, n, t);
+        for (std::size_t i = 0; i < n; i++) out[i] *= t[i];
+    }
+    void backward(const real* const* in, std::size_t n, const real* g,
+                  real* const* grads) const {
+        real t[block] = {};
+        this->b.eval(in, n, t);
+        for (std::size_t i = 0; i < n; i++) t[i] *= g[i];
+        this->a.backward(in, n, t, grads);
+        this->a.eval(in, n, t);
+        for (std::size_t i = 0; i < n; i++) t[i] *= g[i];
+        this->b.backward(in, n, t, grads);
+    }
+};
+
+// F provides cost, forward(x, y, n), which may be called with y == x, and
+// derivative(x, n), which replaces x[i] with F'(x[i]).
+template <class A, class F>
+struct unary : expr_t {
+    static constexpr std::size_t arity = A::arity, cost = A::cost + F::cost;
+    A a;
+    explicit unary(const A& a_) : a(a_) {}
+    void eval(const real* const* in, std::size_t n, real* out) const {
+        a.eval(in, n, out);
+        F::forward(out, out, n);
+    }
+    void backward(const real* const* in, std::size_t n, const real* g,
+                  real* const* grads) const {
+        real t[block] = {};
+        a.eval(in, n, t);
+        F::derivative(t, n);
+        for (std::size_t i = 0; i < n; i++) t[i] *= g[i];
+        a.backward(in, n, t, grads);
+    }
+};
+
+struct relu_f {
+    static constexpr std::size_t cost = 1;
+    static void forward(const real* x, real* y, std::size_t n) {
+        for (std::size_t i = 0; i < n; i++) y[i] = std::max((real)0, x[i]);
+    }
+    static void derivative(real* x, std::size_t n) {
+        for (std::size_t i = 0; i < n; i++) x[i] = x[i] > 0 ? 1 : 0;
+    }
+};
+
+struct log_f {
+    static constexpr std::size_t cost = 10;
+    static void forward(const real* x, real* y, std::size_t n) {
+        vlog(x, y, n);
+    }
+    static void derivative(real* x, std::size_t n) {
+        for (std::size_t i = 0; i < n; i++) x[i] = 1 / x[i];
+    }
+};
+
+struct exp_f {
+    static constexpr std::size_t cost = 10;
+    static void forward(const real* x, real* y, std::size_t n) {
+        vexp(x, y, n);
+    }
+    static void derivative(real* x, std::size_t n) { vexp(x, x, n); }
+};
+
+struct sigmoid_f {
+    static constexpr std::size_t cost = 10;
+    static void forward(const real* x, real* y, std::size_t n) {
+        vsigmoid(x, y, n);
+    }
+    static void derivative(real* x, std::size_t n) {
+        vsigmoid(x, x, n);
+        for (std::size_t i = 0; i < n; i++) x[i] *= 1 - x[i];
+    }
+};
+
+struct tanh_f {
+    static constexpr std::size_t cost = 10;
+    static void forward(const real* x, real* y, std::size_t n) {
+        vtanh(x, y, n);
+    }
+    static void derivative(real* x, std::size_t n) {
+        vtanh(x, x, n);
+        for (std::size_t i = 0; i < n; i++) x[i] = 1 - x[i] * x[i];
+    }
+};
+
+struct gelu_f {
+    static constexpr std::size_t cost = 12;
+    static void forward(const real* x, real* y, std::size_t n) {
+        vgelu(x, y, n);
+    }
+    static void derivative(real* x, std::size_t n) {
+        real s[block] = {};
+        for (std::size_t i = 0; i < n; i++)
+            s[i] = gelu_c * x[i] * (1 + gelu_a * x[i] * x[i]);
+        vsigmoid(s, s, n);
+        for (std::size_t i = 0; i < n; i++)
+            x[i] = s[i] + x[i] * s[i] * (1 - s[i]) * gelu_c *
+                              (1 + 3 * gelu_a * x[i] * x[i]);
+    }
+};
+
+// Numbers mixed into expressions become constants.
+template <class T>
+using lifted = std::conditional_t<is_expr<T>, T, constant>;
+
+template <class T>
+lifted<T> lift(const T& x) {
+    if constexpr (is_expr<T>)
+        return x;
+    else
+        return constant(x);
+}
+
+template <class T>
+constexpr bool operand = is_expr<T> || std::is_arithmetic<T>::value;
+
+template <class A, class B>
+using enable_binary =
+    std::enable_if_t<(is_expr<A> || is_expr<B>) && operand<A> && operand<B>,
+                     int>;
+
+template <class A>
+using enable_unary = std::enable_if_t<is_expr<A>, int>;
+
+template <class A, class B, enable_binary<A, B> = 0>
+sum<lifted<A>, lifted<B>> operator+(const A& a, const B& b) {
+    return {lift(a), lift(b)};
+}
+
+template <class A, class B, enable_binary<A, B> = 0>
+difference<lifted<A>, lifted<B>> operator-(const A& a, const B& b) {
+    return {lift(a), lift(b)};
+}
+
+template <class A, class B, enable_binary<A, B> = 0>
+product<lifted<A>, lifted<B>> operator*(const A& a, const B& b) {
+    return {lift(a), lift(b)};
+}
+
+template <class A, enable_unary<A> = 0>
+product<constant, A> operator-(const A& a) {
+    return {constant(-1), a};
+}
+
+template <class A, enable_unary<A> = 0>
+unary<A, relu_f> relu(const A& a) {
+    return unary<A, relu_f>(a);
+}
+
+template <class A, enable_unary<A> = 0>
+unary<A, log_f> log(const A& a) {
+    return unary<A, log_f>(a);
+}
+
+template <class A, enable_unary<A> = 0>
+unary<A, exp_f> exp(const A& a) {
+    return unary<A, exp_f>(a);
+}
+
+template <class A, enable_unary<A> = 0>
+unary<A, sigmoid_f> sigmoid(const A& a) {
+    return unary<A, sigmoid_f>(a);
+}
+
+template <class A, enable_unary<A> = 0>
+unary<A, tanh_f> tanh(const A& a) {
+    return unary<A, tanh_f>(a);
+}
+
+template <class A, enable_unary<A> = 0>
+unary<A, gelu_f> gelu(const A& a) {
+    return unary<A, gelu_f>(a);
+}
+
+}  // namespace fused
+
+// Lets graph rewrites such as quantize copy fused nodes without knowing
+// their expression type.
+struct fused_node_base : public node_t {
+    virtual node_t* rebuild(node_t* const* inputs,
+                            const std::string& name) const = 0;
+};
+
+template <class E, std::size_t N>
+struct fused_node : public fused_node_base {
+    static_assert(N > 0, "A fused node needs an input to take its shape");
+    static_assert(E::arity <= N, "The expression uses more inputs than given");
+    E expr;
+    explicit fused_node(const E& expr_) : expr(expr_) {}
+    virtual void compute(const input_t& input, context_t& ctx) override;
+    virtual void differentiate() override;
+    virtual node_t* rebuild(node_t* const* inputs,
+                            const std::string& name) const override;
+};
+
+template <class E, std::size_t N,
+          std::enable_if_t<fused::is_expr<E>, int> = 0>
+fused_node<E, N>* fuse(const E& expr, node_t* const (&inputs)[N],
+                       const std::string& name = "") {
+    auto g = inputs[0]->graph;
+    for (auto a : inputs)
+        if (a->value.shape != inputs[0]->value.shape)
+            PANIC("Shape mismatch between nodes {} and {}", inputs[0]->name,
+                  a->name);
+    auto i = g->nodes.size();
+    auto u = new fused_node<E, N>(expr);
+    for (auto a : inputs) {
+        a->successors.push_back(i);
+        u->dependencies.push_back(a->index);
+    }
+    u->index = i;
+    u->name = name;
+    u->graph = g;
+    allocate_buffers(u, inputs[0]->value.shape);
+    u->parameterp = false;
+    u->graph->nodes.push_back(u);
+    u->graph->name_tbl[name] = u;
+    return u;
+}
+
+template <class E, std::size_t N>
+void fused_node<E, N>::compute(const input_t& input, context_t& ctx) {
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(E::cost), [&](std::size_t begin,
+                                               std::size_t end) {
+        const real* in[N];
+        for (auto lo = begin; lo < end; lo += fused::block) {
+            auto n = std::min(fused::block, end - lo);
+            for (std::size_t k = 0; k < N; k++)
+                in[k] = ctx.values[dependencies[k]].data + lo;
+            expr.eval(in, n, y.data + lo);
+        }
+    });
+}
+
+template <class E, std::size_t N>
+void fused_node<E, N>::differentiate() {
+    auto size = shape_to_size(value.shape);
+    auto chunk = backward_grain_for(2 * E::cost);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        const real* in[N];
+        real* grads[N];
+        for (auto lo = begin; lo < end; lo += fused::block) {
+            auto n = std::min(fused::block, end - lo);
+            for (std::size_t k = 0; k < N; k++) {
+                auto& a = *(graph->nodes[dependencies[k]]);
+                in[k] = a.value.data + lo;
+                grads[k] = a.adjoint.data + lo;
+            }
+            expr.backward(in, n, adjoint.data + lo, grads);
+        }
+    });
+}
+
+template <class E, std::size_t N>
+node_t* fused_node<E, N>::rebuild(node_t* const* inputs,
+                                  const std::string& name) const {
+    node_t* copy[N];
+    std::copy(inputs, inputs + N, copy);
+    return fuse(expr, copy, name);
+}
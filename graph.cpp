@@ -1,14 +1,164 @@
 #include "graph.h"
 
 #include <algorithm>
-#include <execution>
+#include <chrono>
+#include <cmath>
 #include <queue>
 
 #include "control_flow.h"
+#include "metrics.h"
+#include "passes.h"
+#include "runtime.h"
+#include "simd_math.h"
+#include "tune.h"
 
 std::size_t graph_t::size() { return nodes.size(); }
 
+node_t::~node_t() {
+    delete_tensor(value, buffer_kind::value);
+    delete_tensor(adjoint, buffer_kind::adjoint);
+    delete_tensor(acc, buffer_kind::acc);
+    metrics().remove_node(this);
+}
+
+void allocate_buffers(node_t* u, const shape_t& shape) {
+    u->value = new_tensor(shape, buffer_kind::value);
+    if (u->graph->forward_onlyp) {
+        u->adjoint = u->acc = tensor_t{{}, {0}, nullptr};
+        metrics().add_node_bytes(u, shape_to_size(shape) * sizeof(real));
+        return;
+    }
+    u->adjoint = new_tensor(shape, buffer_kind::adjoint);
+    u->acc = new_tensor(shape, buffer_kind::acc);
+    metrics().add_node_bytes(u, 3 * shape_to_size(shape) * sizeof(real));
+}
+
+bool node_t::equivalent(const node_t& other) const { return false; }
+
+node_state_t* node_t::new_state() const { return nullptr; }
+
+node_state_t* multiplication::new_state() const { return new state_t; }
+
+context_t::context_t(graph_t* graph_, bool sharedp) : graph(graph_) {
+    for (auto u : graph->nodes) {
+        auto own = !sharedp && !u->parameterp;
+        values.push_back(own ? new_tensor(u->value.shape, buffer_kind::value)
+                             : u->value);
+        owned.push_back(own);
+        states.push_back(u->new_state());
+    }
+}
+
+context_t::~context_t() {
+    for (std::size_t i = 0; i < values.size(); i++) {
+        if (owned[i]) delete_tensor(values[i], buffer_kind::value);
+        delete states[i];
+    }
+}
+
+const tensor_t& context_t::value(const node_t* u) const {
+    return values[u->index];
+}
+
+std::size_t node_t::grain_for(std::size_t cost) const {
+    return grain ? grain : grain_size(cost);
+}
+
+std::size_t node_t::backward_grain_for(std::size_t cost) const {
+    return backward_grain ? backward_grain : grain_size(cost);
+}
+
+bool multiplication::equivalent(const node_t& other) const {
+    auto u = dynamic_cast<const multiplication*>(&other);
+    return u && u->alpha == alpha && u->transpose_a == transpose_a &&
+           u->transpose_b == transpose_b;
+}
+
+bool addition::equivalent(const node_t& other) const {
+    return dynamic_cast<const addition*>(&other);
+}
+
+bool log_node::equivalent(const node_t& other) const {
+    return dynamic_cast<const log_node*>(&other);
+}
+
+bool reshape_node::equivalent(const node_t& other) const {
+    return dynamic_cast<const reshape_node*>(&other) &&
+           other.value.shape == value.shape;
+}
+
+bool relu_node::equivalent(const node_t& other) const {
+    return dynamic_cast<const relu_node*>(&other);
+}
+
+bool softmax_node::equivalent(const node_t& other) const {
+    return dynamic_cast<const softmax_node*>(&other);
+}
+
+bool sigmoid_node::equivalent(const node_t& other) const {
+    return dynamic_cast<const sigmoid_node*>(&other);
+}
+
+bool tanh_node::equivalent(const node_t& other) const {
+    return dynamic_cast<const tanh_node*>(&other);
+}
+
+bool gelu_node::equivalent(const node_t& other) const {
+    return dynamic_cast<const gelu_node*>(&other);
+}
+
+bool embedding_node::equivalent(const node_t& other) const {
+    return dynamic_cast<const embedding_node*>(&other);
+}
+
+bool scalar_multiplication::equivalent(const node_t& other) const {
+    auto u = dynamic_cast<const scalar_multiplication*>(&other);
+    return u && u->a == a;
+}
+
+void row_set_t::mark(std::size_t i) {
+    if (markedp[i]) return;
+    markedp[i] = true;
+    rows.push_back(i);
+}
+
+void row_set_t::clear() {
+    for (auto i : rows) markedp[i] = false;
+    rows.clear();
+}
+
 void graph_t::finalize() {
+    if (!passes.empty()) {
+        // The last node is kept last, as the optimizers take it as the loss.
+        outputs.insert(outputs.begin(), size() - 1);
+        for (auto pass : passes) {
+            auto changes = pass->run(this);
+            spdlog::info("Pass {} made {} changes", pass->name(), changes);
+            compact();
+        }
+        auto result = outputs[0];
+        outputs.erase(outputs.begin());
+        if (!nodes[result]->successors.empty())
+            PANIC("Passes turned the loss into node {}, which has other users",
+                  nodes[result]->name);
+        if (result != size() - 1) {
+            std::vector<std::size_t> old(size());
+            for (std::size_t i = 0; i < size(); i++) old[i] = i;
+            old.erase(old.begin() + result);
+            old.push_back(result);
+            renumber(old);
+        }
+    }
+    for (auto u : nodes) {
+        auto p = dynamic_cast<parameter*>(u);
+        if (!p || !p->sparse_gradp) continue;
+        for (auto s : p->successors)
+            if (!dynamic_cast<embedding_node*>(nodes[s]) ||
+                nodes[s]->dependencies[0] != p->index)
+                PANIC("Parameter {} with sparse gradients is used by node {} "
+                      "other than as an embedding table",
+                      p->name, nodes[s]->name);
+    }
     order.clear();
     std::queue<std::size_t> q;
     std::vector<std::size_t> deg(size());
@@ -25,28 +175,117 @@ void graph_t::finalize() {
         }
         q.pop();
     }
+    delete context;
+    context = new context_t(this, true);
+    if (tune) autotune(this, tuning_cache);
+}
+
+void graph_t::mark_output(node_t* u) {
+    if (u->graph != this) PANIC("Node {} is not from this graph", u->name);
+    outputs.push_back(u->index);
+}
+
+bool graph_t::outputp(const node_t* u) const {
+    return u->index + 1 == nodes.size() ||
+           std::find(outputs.begin(), outputs.end(), u->index) != outputs.end();
+}
+
+void graph_t::replace(node_t* u, node_t* v) {
+    for (auto s : u->successors) {
+        auto& deps = nodes[s]->dependencies;
+        std::replace(deps.begin(), deps.end(), u->index, v->index);
+        v->successors.push_back(s);
+    }
+    u->successors.clear();
+    for (auto& [name, node] : name_tbl)
+        if (node == u) node = v;
+}
+
+void graph_t::erase(node_t* u) {
+    if (!u->successors.empty())
+        PANIC("Erasing node {} which is still in use", u->name);
+    if (outputp(u)) PANIC("Erasing node {} which is an output", u->name);
+    for (auto d : u->dependencies) {
+        auto& succ = nodes[d]->successors;
+        auto it = std::find(succ.begin(), succ.end(), u->index);
+        if (it != succ.end()) succ.erase(it);
+    }
+    u->dependencies.clear();
+    erased.push_back(u->index);
+}
+
+void graph_t::compact() {
+    std::vector<bool> erasedp(size(), false);
+    for (auto i : erased) erasedp[i] = true;
+    erased.clear();
+    std::vector<std::size_t> old;
+    for (std::size_t i = 0; i < size(); i++) {
+        if (!erasedp[i]) continue;
+        for (auto it = name_tbl.begin(); it != name_tbl.end();) {
+            if (it->second == nodes[i])
+                it = name_tbl.erase(it);
+            else
+                it++;
+        }
+        delete nodes[i];
+    }
+    for (std::size_t i = 0; i < size(); i++)
+        if (!erasedp[i]) old.push_back(i);
+    renumber(old);
+}
+
+void graph_t::renumber(const std::vector<std::size_t>& old) {
+    std::vector<std::size_t> index(size(), size());
+    for (std::size_t i = 0; i < old.size(); i++) index[old[i]] = i;
+    std::vector<node_t*> renumbered;
+    for (auto i : old) {
+        auto u = nodes[i];
+        u->index = index[i];
+        metrics().relabel_node(u);
+        for (auto& d : u->dependencies) d = index[d];
+        for (auto& s : u->successors) s = index[s];
+        renumbered.push_back(u);
+    }
+    nodes = renumbered;
+    for (auto& o : outputs) o = index[o];
 }
 
 void graph_t::compute(const input_t& input) {
+    if (!context) PANIC("Graph is computed before being finalized");
     for (std::size_t i = 0; i < nodes.size(); i++) {
         auto& u = *(nodes[i]);
+        if (!u.adjoint.data) continue;
+        if (auto p = dynamic_cast<parameter*>(&u); p && p->sparse_gradp) {
+            auto width = u.value.shape[1];
+            for (auto r : p->adjoint_rows.rows)
+                std::fill(u.adjoint.data + r * width,
+                          u.adjoint.data + (r + 1) * width, 0);
+            p->adjoint_rows.clear();
+            continue;
+        }
         auto size = shape_to_size(u.value.shape);
         for (std::size_t j = 0; j < size; j++) {
             u.adjoint.data[j] = 0;
         }
     }
-    for (auto node : order) nodes[node]->compute(input);
+    compute(input, *context);
+}
+
+void graph_t::compute(const input_t& input, context_t& ctx) {
+    if (ctx.graph != this) PANIC("Context belongs to another graph");
+    auto start = std::chrono::steady_clock::now();
+    for (auto node : order) nodes[node]->compute(input, ctx);
+    auto& m = metrics();
+    m.record(m.compute, seconds_since(start));
 }
 
 placeholder* graph_t::add_placeholder(const shape_t& shape,
                                       const std::string& name) {
     auto u = new placeholder;
-    u->value = new_tensor(shape);
-    u->adjoint = new_tensor(shape);
-    u->acc = new_tensor(shape);
     u->name = name;
     u->index = nodes.size();
     u->graph = this;
+    allocate_buffers(u, shape);
     u->parameterp = false;
     nodes.push_back(u);
     name_tbl[name] = u;
@@ -56,41 +295,46 @@ placeholder* graph_t::add_placeholder(const shape_t& shape,
 parameter* graph_t::add_parameter(const shape_t& shape,
                                   const std::string& name) {
     auto u = new parameter;
-    u->value = new_tensor(shape);
-    u->adjoint = new_tensor(shape);
-    u->acc = new_tensor(shape);
     u->name = name;
     u->index = nodes.size();
     u->graph = this;
+    allocate_buffers(u, shape);
     u->parameterp = true;
     nodes.push_back(u);
     name_tbl[name] = u;
     return u;
 }
 
-void placeholder::compute(const input_t& input) {
+void placeholder::compute(const input_t& input, context_t& ctx) {
     if (!input.count(name))
         PANIC("Input for placeholder node {} is unspecified", name);
     if (input.find(name)->second.shape != value.shape)
         PANIC("Input for placeholder node {} has a wrong shape", name);
     auto in = input.find(name)->second;
-    auto size = shape_to_size(value.shape);
-    std::copy(std::execution::par_unseq, in.data, in.data + size, value.data);
-    // for (std::size_t i = 0; i < size; i++) value.data[i] = in.data[i];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(1), [&](std::size_t begin, std::size_t end) {
+        std::copy(in.data + begin, in.data + end, y.data + begin);
+    });
 }
 
 void placeholder::differentiate() {}
 
-void parameter::compute(const input_t& input) {}
+void parameter::compute(const input_t& input, context_t& ctx) {}
 
 void parameter::differentiate() {}
 
 multiplication* multiply(node_t* a, node_t* b, const std::string& name) {
+    return multiply(a, b, false, false, name);
+}
+
+multiplication* multiply(node_t* a, node_t* b, bool transpose_a,
+                         bool transpose_b, const std::string& name) {
     if (a->graph != b->graph)
         PANIC("Nodes {} and {} are not from the same graph", a->name, b->name);
     if (a->value.shape.size() != 2) PANIC("Node {} is not a matrix", a->name);
     if (b->value.shape.size() != 2) PANIC("Node {} is not a matrix", b->name);
-    if (a->value.shape[1] != b->value.shape[0])
+    if (a->value.shape[!transpose_a] != b->value.shape[transpose_b])
         PANIC(
             "Shapes of nodes {} and {} do not match for matrix multiplication",
             a->name, b->name);
@@ -98,14 +342,14 @@ multiplication* multiply(node_t* a, node_t* b, const std::string& name) {
     a->successors.push_back(i);
     b->successors.push_back(i);
     auto u = new multiplication;
-    shape_t shape{a->value.shape[0], b->value.shape[1]};
-    u->value = new_tensor(shape);
-    u->adjoint = new_tensor(shape);
-    u->acc = new_tensor(shape);
+    shape_t shape{a->value.shape[transpose_a], b->value.shape[!transpose_b]};
+    u->transpose_a = transpose_a;
+    u->transpose_b = transpose_b;
     u->dependencies = {a->index, b->index};
     u->index = i;
     u->name = name;
     u->graph = a->graph;
+    allocate_buffers(u, shape);
     u->parameterp = false;
     u->graph->nodes.push_back(u);
     u->graph->name_tbl[name] = u;
@@ -121,13 +365,11 @@ addition* add(node_t* a, node_t* b, const std::string& name) {
     a->successors.push_back(i);
     b->successors.push_back(i);
     auto u = new addition;
-    u->value = new_tensor(a->value.shape);
-    u->adjoint = new_tensor(a->value.shape);
-    u->acc = new_tensor(a->value.shape);
     u->dependencies = {a->index, b->index};
     u->index = i;
     u->name = name;
     u->graph = a->graph;
+    allocate_buffers(u, a->value.shape);
     u->parameterp = false;
     u->graph->nodes.push_back(u);
     u->graph->name_tbl[name] = u;
@@ -138,13 +380,11 @@ log_node* log_tensor(node_t* a, const std::string& name) {
     auto i = a->graph->nodes.size();
     a->successors.push_back(i);
     auto u = new log_node;
-    u->value = new_tensor(a->value.shape);
-    u->adjoint = new_tensor(a->value.shape);
-    u->acc = new_tensor(a->value.shape);
     u->dependencies = {a->index};
     u->index = i;
     u->name = name;
     u->graph = a->graph;
+    allocate_buffers(u, a->value.shape);
     u->parameterp = false;
     u->graph->nodes.push_back(u);
     u->graph->name_tbl[name] = u;
@@ -158,13 +398,11 @@ reshape_node* reshape(node_t* a, const shape_t& shape,
     auto i = a->graph->nodes.size();
     a->successors.push_back(i);
     auto u = new reshape_node;
-    u->value = new_tensor(shape);
-    u->adjoint = new_tensor(shape);
-    u->acc = new_tensor(shape);
     u->dependencies = {a->index};
     u->index = i;
     u->name = name;
     u->graph = a->graph;
+    allocate_buffers(u, shape);
     u->parameterp = false;
     u->graph->nodes.push_back(u);
     u->graph->name_tbl[name] = u;
@@ -175,13 +413,11 @@ relu_node* relu(node_t* a, const std::string& name) {
     auto i = a->graph->nodes.size();
     a->successors.push_back(i);
     auto u = new relu_node;
-    u->value = new_tensor(a->value.shape);
-    u->adjoint = new_tensor(a->value.shape);
-    u->acc = new_tensor(a->value.shape);
     u->dependencies = {a->index};
     u->index = i;
     u->name = name;
     u->graph = a->graph;
+    allocate_buffers(u, a->value.shape);
     u->parameterp = false;
     u->graph->nodes.push_back(u);
     u->graph->name_tbl[name] = u;
@@ -192,13 +428,87 @@ softmax_node* softmax(node_t* a, const std::string& name) {
     auto i = a->graph->nodes.size();
     a->successors.push_back(i);
     auto u = new softmax_node;
-    u->value = new_tensor(a->value.shape);
-    u->adjoint = new_tensor(a->value.shape);
-    u->acc = new_tensor(a->value.shape);
     u->dependencies = {a->index};
     u->index = i;
     u->name = name;
     u->graph = a->graph;
+    allocate_buffers(u, a->value.shape);
+    u->parameterp = false;
+    u->graph->nodes.push_back(u);
+    u->graph->name_tbl[name] = u;
+    return u;
+}
+
+sigmoid_node* sigmoid(node_t* a, const std::string& name) {
+    auto i = a->graph->nodes.size();
+    a->successors.push_back(i);
+    auto u = new sigmoid_node;
+    u->dependencies = {a->index};
+    u->index = i;
+    u->name = name;
+    u->graph = a->graph;
+    allocate_buffers(u, a->value.shape);
+    u->parameterp = false;
+    u->graph->nodes.push_back(u);
+    u->graph->name_tbl[name] = u;
+    return u;
+}
+
+tanh_node* tanh_tensor(node_t* a, const std::string& name) {
+    auto i = a->graph->nodes.size();
+    a->successors.push_back(i);
+    auto u = new tanh_node;
+    u->dependencies = {a->index};
+    u->index = i;
+    u->name = name;
+    u->graph = a->graph;
+    allocate_buffers(u, a->value.shape);
+    u->parameterp = false;
+    u->graph->nodes.push_back(u);
+    u->graph->name_tbl[name] = u;
+    return u;
+}
+
+gelu_node* gelu(node_t* a, const std::string& name) {
+    auto i = a->graph->nodes.size();
+    a->successors.push_back(i);
+    auto u = new gelu_node;
+    u->dependencies = {a->index};
+    u->index = i;
+    u->name = name;
+    u->graph = a->graph;
+    allocate_buffers(u, a->value.shape);
+    u->parameterp = false;
+    u->graph->nodes.push_back(u);
+    u->graph->name_tbl[name] = u;
+    return u;
+}
+
+embedding_node* embedding(node_t* table, node_t* ids,
+                          const std::string& name) {
+    auto p = dynamic_cast<parameter*>(table);
+    if (!p) PANIC("Embedding table {} is not a parameter", table->name);
+    if (table->value.shape.size() != 2 || ids->value.shape.size() != 2 ||
+        ids->value.shape[1] != 1)
+        PANIC("Shape mismatch between nodes {} and {}", table->name,
+              ids->name);
+    if (!p->sparse_gradp) {
+        // From now on only marked rows are cleared, so start from zero.
+        zero_init(p->adjoint);
+        zero_init(p->acc);
+        p->sparse_gradp = true;
+        p->adjoint_rows.markedp.assign(table->value.shape[0], false);
+        p->acc_rows.markedp.assign(table->value.shape[0], false);
+    }
+    auto i = table->graph->nodes.size();
+    table->successors.push_back(i);
+    ids->successors.push_back(i);
+    auto u = new embedding_node;
+    u->dependencies = {table->index, ids->index};
+    u->index = i;
+    u->name = name;
+    u->graph = table->graph;
+    allocate_buffers(u, {ids->value.shape[0], table->value.shape[1]});
     u->parameterp = false;
     u->graph->nodes.push_back(u);
     u->graph->name_tbl[name] = u;
@@ -209,13 +519,11 @@ scalar_multiplication* multiply(real a, node_t* b, const std::string& name) {
     auto i = b->graph->nodes.size();
     b->successors.push_back(i);
     auto u = new scalar_multiplication;
-    u->value = new_tensor(b->value.shape);
-    u->adjoint = new_tensor(b->value.shape);
-    u->acc = new_tensor(b->value.shape);
     u->dependencies = {b->index};
     u->index = i;
     u->name = name;
     u->graph = b->graph;
+    allocate_buffers(u, b->value.shape);
     u->parameterp = false;
     u->graph->nodes.push_back(u);
     u->a = a;
@@ -241,158 +549,396 @@ void zero_init(tensor_t u) {
     for (std::size_t i = 0; i < size; i++) u.data[i] = 0;
 }
 
-void multiplication::compute(const input_t& input) {
-    node_t& a = *(graph->nodes[dependencies[0]]);
-    node_t& b = *(graph->nodes[dependencies[1]]);
-    auto n = a.value.shape[0];
-    auto m = a.value.shape[1];
-    auto l = b.value.shape[1];
-    std::fill(std::execution::par_unseq, value.data, value.data + n * l, 0);
-    std::vector<std::size_t> is(n);
-    for (std::size_t i = 0; i < n; i++) is[i] = i;
-    std::for_each(std::execution::par_unseq, is.begin(), is.end(),
-                  [&](std::size_t i) {
-                      auto il = i * l, im = i * m;
-                      for (std::size_t j = 0; j < m; j++) {
-                          auto jl = j * l;
-                          auto t = a.value.data[im + j];
-                          for (std::size_t k = 0; k < l; k++) {
-                              value.data[il + k] += t * b.value.data[jl + k];
-                          }
-                      }
-                  });
+// Element (i, j) of a strided matrix is at data[i * row + j * col].
+struct matrix_view {
+    real* data;
+    std::size_t row, col;
+    real operator()(std::size_t i, std::size_t j) const {
+        return data[i * row + j * col];
+    }
+    matrix_view t() const { return {data, col, row}; }
+};
+
+// op(u) for a matrix node value u.
+static matrix_view view(const tensor_t& u, bool transpose) {
+    matrix_view v{u.data, u.shape[1], 1};
+    return transpose ? v.t() : v;
 }
 
-void multiplication::differentiate() {
-    node_t& a = *(graph->nodes[dependencies[0]]);
-    node_t& b = *(graph->nodes[dependencies[1]]);
-    auto n = a.value.shape[0];
-    auto m = a.value.shape[1];
-    auto l = b.value.shape[1];
-    std::vector<std::size_t> is(n);
-    for (std::size_t i = 0; i < n; i++) is[i] = i;
-    std::for_each(
-        std::execution::par_unseq, is.begin(), is.end(), [&](std::size_t i) {
-            auto im = i * m, il = i * l;
-            for (std::size_t j = 0; j < m; j++) {
-                auto jl = j * l;
-                auto t = a.value.data[im + j];
-                for (std::size_t k = 0; k < l; k++) {
-                    a.adjoint.data[im + j] +=
-                        adjoint.data[il + k] * b.value.data[jl + k];
-                    b.adjoint.data[jl + k] += t * adjoint.data[il + k];
+// c[n x l] += alpha * a[n x m] b[m x l], where c is contiguous. Only the rows
+// of c listed in rows, the inner indices listed in inner and the columns of c
+// listed in cols are visited; a null list stands for all indices. order and
+// grain override the loop order and the rows per thread when nonzero.
+static void gemm(std::size_t n, std::size_t m, std::size_t l, real alpha,
+                 matrix_view a, matrix_view b, real* c,
+                 const std::vector<std::size_t>* rows,
+                 const std::vector<std::size_t>* inner,
+                 const std::vector<std::size_t>* cols,
+                 loop_order order = loop_order::automatic,
+                 std::size_t grain = 0) {
+    auto each = [](const std::vector<std::size_t>* list, std::size_t size,
+                   auto f) {
+        if (list) {
+            for (auto x : *list) f(x);
+        } else {
+            for (std::size_t x = 0; x < size; x++) f(x);
+        }
+    };
+    auto inner_size = inner ? inner->size() : m;
+    auto cols_size = cols ? cols->size() : l;
+    auto row = [&](std::size_t i) {
+        auto ci = c + i * l;
+        bool dot = order == loop_order::automatic ? b.row == 1
+                                                  : order == loop_order::dot;
+        if (dot) {
+            // One dot product per element, best when the inner index is
+            // contiguous in b.
+            each(cols, l, [&](std::size_t k) {
+                real sum = 0;
+                if (!inner && a.col == 1 && b.row == 1) {
+                    auto ai = a.data + i * a.row, bk = b.data + k * b.col;
+                    real s[4] = {0, 0, 0, 0};
+                    std::size_t j = 0;
+                    for (; j + 4 <= m; j += 4)
+                        for (std::size_t r = 0; r < 4; r++)
+                            s[r] += ai[j + r] * bk[j + r];
+                    for (; j < m; j++) sum += ai[j] * bk[j];
+                    sum += (s[0] + s[1]) + (s[2] + s[3]);
+                } else {
+                    each(inner, m,
+                         [&](std::size_t j) { sum += a(i, j) * b(j, k); });
                 }
+                ci[k] += alpha * sum;
+            });
+        } else {
+            // Add multiples of rows of b to the row of c, best when the rows
+            // of b are contiguous.
+            each(inner, m, [&](std::size_t j) {
+                auto t = alpha * a(i, j);
+                auto bj = b.data + j * b.row;
+                if (cols) {
+                    for (auto k : *cols) ci[k] += t * bj[k * b.col];
+                } else if (b.col == 1) {
+                    for (std::size_t k = 0; k < l; k++) ci[k] += t * bj[k];
+                } else {
+                    for (std::size_t k = 0; k < l; k++)
+                        ci[k] += t * bj[k * b.col];
+                }
+            });
+        }
+    };
+    auto rows_size = rows ? rows->size() : n;
+    if (!grain) grain = grain_size(inner_size * cols_size);
+    parallel_for(rows_size, grain,
+                 [&](std::size_t begin, std::size_t end) {
+                     for (std::size_t r = begin; r < end; r++)
+                         row(rows ? (*rows)[r] : r);
+                 });
+}
+
+void multiplication::compute(const input_t& input, context_t& ctx) {
+    auto& a = ctx.values[dependencies[0]];
+    auto& b = ctx.values[dependencies[1]];
+    auto& y = ctx.values[index];
+    auto& [sparsep, active] = ctx.state<state_t>(index);
+    auto n = y.shape[0];
+    auto m = a.shape[!transpose_a];
+    auto l = y.shape[1];
+    auto va = view(a, transpose_a), vb = view(b, transpose_b);
+    active.clear();
+    for (std::size_t j = 0; j < m; j++) {
+        for (std::size_t k = 0; k < l; k++) {
+            if (vb(j, k) != 0) {
+                active.push_back(j);
+                break;
             }
-        });
+        }
+    }
+    sparsep = active.size() <= (1 - sparsity_threshold) * m;
+    std::fill(y.data, y.data + n * l, 0);
+    const auto& kernel = sparsep ? sparse_kernel : dense_kernel;
+    gemm(n, m, l, alpha, va, vb, y.data, nullptr,
+         sparsep ? &active : nullptr, nullptr, kernel.order, kernel.grain);
 }
 
-void addition::compute(const input_t& input) {
+void multiplication::differentiate() {
     node_t& a = *(graph->nodes[dependencies[0]]);
     node_t& b = *(graph->nodes[dependencies[1]]);
-    auto size = shape_to_size(value.shape);
-    std::for_each(std::execution::par_unseq, value.data, value.data + size,
-                  [&](real& p) {
-                      auto i = &p - value.data;
-                      p = a.value.data[i] + b.value.data[i];
-                  });
+    auto n = value.shape[0];
+    auto m = a.value.shape[!transpose_a];
+    auto l = value.shape[1];
+    auto va = view(a.value, transpose_a), vb = view(b.value, transpose_b);
+    matrix_view dc{adjoint.data, l, 1};
+    const auto& [sparsep, active] = graph->context->state<state_t>(index);
+    auto grain = (sparsep ? sparse_kernel : dense_kernel).backward_grain;
+    // Placeholders do not propagate their adjoints anywhere.
+    if (!dynamic_cast<placeholder*>(&a)) {
+        // d op(a) = alpha * dc op(b)^T, whose columns for the rows of op(b)
+        // that are all zero are zero.
+        auto skip = sparsep ? &active : nullptr;
+        if (!transpose_a)
+            gemm(n, l, m, alpha, dc, vb.t(), a.adjoint.data, nullptr, nullptr,
+                 skip, loop_order::automatic, grain);
+        else
+            gemm(m, l, n, alpha, vb, dc.t(), a.adjoint.data, skip, nullptr,
+                 nullptr, loop_order::automatic, grain);
+    }
+    if (!dynamic_cast<placeholder*>(&b)) {
+        // d op(b) = alpha * op(a)^T dc.
+        if (!transpose_b)
+            gemm(m, n, l, alpha, va.t(), dc, b.adjoint.data, nullptr, nullptr,
+                 nullptr, loop_order::automatic, grain);
+        else
+            gemm(l, n, m, alpha, dc.t(), va, b.adjoint.data, nullptr, nullptr,
+                 nullptr, loop_order::automatic, grain);
+    }
+}
+
+void addition::compute(const input_t& input, context_t& ctx) {
+    auto& a = ctx.values[dependencies[0]];
+    auto& b = ctx.values[dependencies[1]];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(1), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            y.data[i] = a.data[i] + b.data[i];
+    });
 }
 
 void addition::differentiate() {
     node_t& a = *(graph->nodes[dependencies[0]]);
     node_t& b = *(graph->nodes[dependencies[1]]);
     auto size = shape_to_size(value.shape);
-    std::for_each(std::execution::par_unseq, adjoint.data, adjoint.data + size,
-                  [&](real& p) {
-                      auto i = &p - adjoint.data;
-                      a.adjoint.data[i] += p;
-                      b.adjoint.data[i] += p;
-                  });
+    auto chunk = backward_grain_for(2);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            a.adjoint.data[i] += adjoint.data[i];
+            b.adjoint.data[i] += adjoint.data[i];
+        }
+    });
 }
 
-void log_node::compute(const input_t& input) {
-    node_t& a = *(graph->nodes[dependencies[0]]);
-    auto size = shape_to_size(value.shape);
-    std::for_each(std::execution::par_unseq, a.value.data, a.value.data + size,
-                  [&](real& p) { value.data[&p - a.value.data] = log(p); });
+void log_node::compute(const input_t& input, context_t& ctx) {
+    auto& a = ctx.values[dependencies[0]];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(10), [&](std::size_t begin, std::size_t end) {
+        vlog(a.data + begin, y.data + begin, end - begin);
+    });
 }
 
 void log_node::differentiate() {
     node_t& a = *(graph->nodes[dependencies[0]]);
     auto size = shape_to_size(value.shape);
-    std::for_each(std::execution::par_unseq, a.adjoint.data,
-                  a.adjoint.data + size, [&](real& p) {
-                      auto i = &p - a.adjoint.data;
-                      p += adjoint.data[i] / a.value.data[i];
-                  });
+    auto chunk = backward_grain_for(4);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            a.adjoint.data[i] += adjoint.data[i] / a.value.data[i];
+    });
 }
 
-void reshape_node::compute(const input_t& input) {
-    node_t& a = *(graph->nodes[dependencies[0]]);
-    auto size = shape_to_size(value.shape);
-    std::copy(std::execution::par_unseq, a.value.data, a.value.data + size,
-              value.data);
+void reshape_node::compute(const input_t& input, context_t& ctx) {
+    auto& a = ctx.values[dependencies[0]];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(1), [&](std::size_t begin, std::size_t end) {
+        std::copy(a.data + begin, a.data + end, y.data + begin);
+    });
 }
 
 void reshape_node::differentiate() {
     node_t& a = *(graph->nodes[dependencies[0]]);
     auto size = shape_to_size(value.shape);
-    std::for_each(std::execution::par_unseq, a.adjoint.data,
-                  a.adjoint.data + size,
-                  [&](real& p) { p += adjoint.data[&p - a.adjoint.data]; });
+    auto chunk = backward_grain_for(1);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            a.adjoint.data[i] += adjoint.data[i];
+    });
 }
 
-void relu_node::compute(const input_t& input) {
-    node_t& a = *(graph->nodes[dependencies[0]]);
-    auto size = shape_to_size(value.shape);
-    std::transform(std::execution::par_unseq, a.value.data, a.value.data + size,
-                   value.data, [](real x) { return std::max((real)0, x); });
+void relu_node::compute(const input_t& input, context_t& ctx) {
+    auto& a = ctx.values[dependencies[0]];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(1), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            y.data[i] = std::max((real)0, a.data[i]);
+    });
 }
 
 void relu_node::differentiate() {
     node_t& a = *(graph->nodes[dependencies[0]]);
     auto size = shape_to_size(value.shape);
-    std::for_each(std::execution::par_unseq, a.adjoint.data,
-                  a.adjoint.data + size, [&](real& p) {
-                      auto i = &p - a.adjoint.data;
-                      p += a.value.data[i] > 0 ? adjoint.data[i] : 0;
-                  });
+    auto chunk = backward_grain_for(1);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            a.adjoint.data[i] += a.value.data[i] > 0 ? adjoint.data[i] : 0;
+    });
+}
+
+void softmax_node::compute(const input_t& input, context_t& ctx) {
+    auto& a = ctx.values[dependencies[0]];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    auto max = *std::max_element(a.data, a.data + size);
+    parallel_for(size, grain_for(10), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            y.data[i] = a.data[i] - max;
+        vexp(y.data + begin, y.data + begin, end - begin);
+    });
+    real sum = 0;
+    for (std::size_t i = 0; i < size; i++) sum += y.data[i];
+    parallel_for(size, grain_for(1), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) y.data[i] /= sum;
+    });
 }
 
-void softmax_node::compute(const input_t& input) {
+void softmax_node::differentiate() {
     node_t& a = *(graph->nodes[dependencies[0]]);
     auto size = shape_to_size(value.shape);
-    auto max = *std::max_element(std::execution::par_unseq, a.value.data,
-                                 a.value.data + size);
-    std::transform(std::execution::par_unseq, a.value.data, a.value.data + size,
-                   value.data, [&](real x) { return exp(x - max); });
-    auto sum =
-        std::reduce(std::execution::par_unseq, value.data, value.data + size);
-    std::transform(std::execution::par_unseq, value.data, value.data + size,
-                   value.data, [sum](real x) { return x / sum; });
+    // The Jacobian is diag(y) - y y^T, so the product with the adjoint only
+    // needs the dot product of y and the adjoint.
+    real dot = 0;
+    for (std::size_t j = 0; j < size; j++) dot += adjoint.data[j] * value.data[j];
+    auto chunk = backward_grain_for(2);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            a.adjoint.data[i] += value.data[i] * (adjoint.data[i] - dot);
+    });
 }
 
-void softmax_node::differentiate() {
+void scalar_multiplication::compute(const input_t& input, context_t& ctx) {
+    auto& b = ctx.values[dependencies[0]];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(1), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            y.data[i] = a * b.data[i];
+    });
+}
+
+void scalar_multiplication::differentiate() {
+    node_t& b = *(graph->nodes[dependencies[0]]);
+    auto size = shape_to_size(value.shape);
+    auto chunk = backward_grain_for(1);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            b.adjoint.data[i] += a * adjoint.data[i];
+    });
+}
+
+void sigmoid_node::compute(const input_t& input, context_t& ctx) {
+    auto& a = ctx.values[dependencies[0]];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(10), [&](std::size_t begin, std::size_t end) {
+        vsigmoid(a.data + begin, y.data + begin, end - begin);
+    });
+}
+
+void sigmoid_node::differentiate() {
     node_t& a = *(graph->nodes[dependencies[0]]);
     auto size = shape_to_size(value.shape);
-    for (std::size_t i = 0; i < size; i++) {
-        for (std::size_t j = 0; j < size; j++) {
+    auto chunk = backward_grain_for(2);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
             a.adjoint.data[i] +=
-                adjoint.data[j] *
-                (i == j ? value.data[i] - value.data[i] * value.data[i]
-                        : -value.data[i] * value.data[j]);
-        }
-    }
+                adjoint.data[i] * value.data[i] * (1 - value.data[i]);
+    });
 }
 
-void scalar_multiplication::compute(const input_t& input) {
-    node_t& b = *(graph->nodes[dependencies[0]]);
+void tanh_node::compute(const input_t& input, context_t& ctx) {
+    auto& a = ctx.values[dependencies[0]];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(10), [&](std::size_t begin, std::size_t end) {
+        vtanh(a.data + begin, y.data + begin, end - begin);
+    });
+}
+
+void tanh_node::differentiate() {
+    node_t& a = *(graph->nodes[dependencies[0]]);
     auto size = shape_to_size(value.shape);
-    for (std::size_t i = 0; i < size; i++) value.data[i] = a * b.value.data[i];
+    auto chunk = backward_grain_for(2);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            a.adjoint.data[i] +=
+                adjoint.data[i] * (1 - value.data[i] * value.data[i]);
+    });
 }
 
-void scalar_multiplication::differentiate() {
-    node_t& b = *(graph->nodes[dependencies[0]]);
+void gelu_node::compute(const input_t& input, context_t& ctx) {
+    auto& a = ctx.values[dependencies[0]];
+    auto& y = ctx.values[index];
+    auto size = shape_to_size(y.shape);
+    parallel_for(size, grain_for(10), [&](std::size_t begin, std::size_t end) {
+        vgelu(a.data + begin, y.data + begin, end - begin);
+    });
+}
+
+void gelu_node::differentiate() {
+    node_t& a = *(graph->nodes[dependencies[0]]);
     auto size = shape_to_size(value.shape);
-    for (std::size_t i = 0; i < size; i++)
-        b.adjoint.data[i] += a * adjoint.data[i];
+    // With z = gelu_c (x + gelu_a x^3) and s = sigmoid(z), the derivative
+    // is s + x s (1 - s) dz/dx. s is recomputed a block at a time.
+    auto chunk = backward_grain_for(12);
+    parallel_for(size, chunk, [&](std::size_t begin, std::size_t end) {
+        const std::size_t block = 256;
+        real s[block];
+        for (auto lo = begin; lo < end; lo += block) {
+            auto n = std::min(block, end - lo);
+            const auto x = a.value.data + lo;
+            for (std::size_t j = 0; j < n; j++)
+                s[j] = gelu_c * x[j] * (1 + gelu_a * x[j] * x[j]);
+            vsigmoid(s, s, n);
+            for (std::size_t j = 0; j < n; j++) {
+                auto dz = gelu_c * (1 + 3 * gelu_a * x[j] * x[j]);
+                a.adjoint.data[lo + j] +=
+                    adjoint.data[lo + j] *
+                    (s[j] + x[j] * s[j] * (1 - s[j]) * dz);
+            }
+        }
+    });
+}
+
+// The row of table selected by id, which is stored as a real.
+static std::size_t embedding_row(real id, std::size_t rows,
+                                 const std::string& name) {
+    if (!(id >= 0 && id < rows) || id != std::floor(id))
+        PANIC("Embedding node {} got id {} outside a table of {} rows", name,
+              id, rows);
+    return (std::size_t)id;
+}
+
+void embedding_node::compute(const input_t& input, context_t& ctx) {
+    auto& table = ctx.values[dependencies[0]];
+    auto& ids = ctx.values[dependencies[1]];
+    auto& y = ctx.values[index];
+    auto n = y.shape[0], width = y.shape[1];
+    parallel_for(n, grain_for(width), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            auto r = embedding_row(ids.data[i], table.shape[0], name);
+            std::copy(table.data + r * width, table.data + (r + 1) * width,
+                      y.data + i * width);
+        }
+    });
+}
+
+void embedding_node::differentiate() {
+    auto& table = *dynamic_cast<parameter*>(graph->nodes[dependencies[0]]);
+    node_t& ids = *(graph->nodes[dependencies[1]]);
+    auto n = value.shape[0], width = value.shape[1];
+    std::vector<std::size_t> rows(n);
+    for (std::size_t i = 0; i < n; i++) {
+        rows[i] = embedding_row(ids.value.data[i], table.value.shape[0], name);
+        table.adjoint_rows.mark(rows[i]);
+    }
+    // Split by columns, as ids may repeat.
+    auto chunk = backward_grain_for(n);
+    parallel_for(width, chunk, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = 0; i < n; i++)
+            for (std::size_t j = begin; j < end; j++)
+                table.adjoint.data[rows[i] * width + j] +=
+                    adjoint.data[i * width + j];
+    });
 }
@@ -8,9 +8,17 @@
 #include "tensor.h"
 
 struct graph_t;
+struct pass_t;
+struct context_t;
 
 using input_t = std::unordered_map<std::string, tensor_t>;
 
+// State of a node that changes on every forward pass without being part of
+// the model, kept per context.
+struct node_state_t {
+    virtual ~node_state_t() = default;
+};
+
 struct node_t {
     tensor_t value, adjoint, acc;
     graph_t* graph;
@@ -18,71 +26,202 @@ struct node_t {
     std::vector<std::size_t> dependencies, successors;
     std::string name;
     bool parameterp;
-    virtual void compute(const input_t& input) = 0;
+    // Items handed to a thread at once by the forward and the backward
+    // kernels of this node; 0 leaves it to grain_size. Set by the autotuner.
+    std::size_t grain = 0, backward_grain = 0;
+    std::size_t grain_for(std::size_t cost) const;
+    std::size_t backward_grain_for(std::size_t cost) const;
+    virtual ~node_t();
+    // Reads the values of the dependencies from ctx and writes the value of
+    // this node there. Must not modify the node itself, as several contexts
+    // may run it at once.
+    virtual void compute(const input_t& input, context_t& ctx) = 0;
+    // Works on the value and adjoint members, that is on graph->context.
     virtual void differentiate() = 0;
+    // State for a new context, or nullptr if compute needs none.
+    virtual node_state_t* new_state() const;
+    // Whether this node computes the same function of its dependencies as
+    // other. Used to merge common subexpressions; nodes holding data of their
+    // own keep the default.
+    virtual bool equivalent(const node_t& other) const;
 };
 
+// Allocates the value, adjoint and acc tensors of a new node, whose graph,
+// index and name are already set. In a forward-only graph the adjoint and acc
+// are left empty, with null data.
+void allocate_buffers(node_t* u, const shape_t& shape);
+
 struct placeholder : public node_t {
-    virtual void compute(const input_t& input) override;
+    virtual void compute(const input_t& input, context_t& ctx) override;
     virtual void differentiate() override;
 };
 
+// Rows of a matrix, each listed once in the order they were marked.
+struct row_set_t {
+    std::vector<std::size_t> rows;
+    std::vector<bool> markedp;
+    void mark(std::size_t i);
+    void clear();
+};
+
 struct parameter : public node_t {
-    virtual void compute(const input_t& input) override;
+    // With sparse_gradp, the adjoint is zero outside adjoint_rows and acc is
+    // zero outside acc_rows, so clearing them and the optimizer updates only
+    // visit those rows. Set by embedding; such a parameter may only be used
+    // as an embedding table.
+    bool sparse_gradp = false;
+    row_set_t adjoint_rows, acc_rows;
+    virtual void compute(const input_t& input, context_t& ctx) override;
     virtual void differentiate() override;
 };
 
+enum class loop_order { automatic, dot, rows };
+
+// Computes alpha * op(a) op(b), where op transposes its operand when the
+// corresponding flag is set. Transposed operands are read in place.
 struct multiplication : public node_t {
-    virtual void compute(const input_t& input) override;
+    bool transpose_a = false, transpose_b = false;
+    // Rows of op(b) holding a nonzero are listed in active when their share
+    // is at most 1 - sparsity_threshold, in which case the products with the
+    // other rows are skipped. The state is updated on every compute and
+    // reused by the following differentiate.
+    real sparsity_threshold = 0.5;
+    struct state_t : public node_state_t {
+        bool sparsep;
+        std::vector<std::size_t> active;
+    };
+    real alpha = 1;
+    // Kernel choices of the autotuner for the dense and the sparse case, used
+    // in place of grain and backward_grain; grains of 0 leave the rows per
+    // thread to grain_size.
+    struct kernel_t {
+        loop_order order = loop_order::automatic;
+        std::size_t grain = 0, backward_grain = 0;
+    };
+    kernel_t dense_kernel, sparse_kernel;
+    virtual void compute(const input_t& input, context_t& ctx) override;
     virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
+    virtual node_state_t* new_state() const override;
 };
 
 multiplication *multiply(node_t *a, node_t *b, const std::string& name = "");
 
+multiplication *multiply(node_t *a, node_t *b, bool transpose_a,
+                         bool transpose_b, const std::string& name = "");
+
 struct addition : public node_t {
-    virtual void compute(const input_t& input) override;
+    virtual void compute(const input_t& input, context_t& ctx) override;
     virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
 };
 
 addition *add(node_t *a, node_t *b, const std::string& name = "");
 
 struct log_node : public node_t {
-    virtual void compute(const input_t& input) override;
+    virtual void compute(const input_t& input, context_t& ctx) override;
     virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
 };
 
 log_node *log_tensor(node_t *a, const std::string& name = "");
 
 struct reshape_node : public node_t {
-    virtual void compute(const input_t& input) override;
+    virtual void compute(const input_t& input, context_t& ctx) override;
     virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
 };
 
 reshape_node *reshape(node_t *a, const shape_t& shape, const std::string& name = "");
 
 struct relu_node : public node_t {
-    virtual void compute(const input_t& input) override;
+    virtual void compute(const input_t& input, context_t& ctx) override;
     virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
 };
 
 relu_node *relu(node_t *a, const std::string& name = "");
 
 struct softmax_node : public node_t {
-    virtual void compute(const input_t& input) override;
+    virtual void compute(const input_t& input, context_t& ctx) override;
     virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
 };
 
 softmax_node *softmax(node_t *a, const std::string& name = "");
 
 struct scalar_multiplication : public node_t {
     real a;
-    virtual void compute(const input_t& input) override;
+    virtual void compute(const input_t& input, context_t& ctx) override;
     virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
 };
 
 scalar_multiplication *multiply(real a, node_t *b, const std::string& name = "");
 
-// TODO: Sigmoid, Convolution, scalar multiplication
+struct sigmoid_node : public node_t {
+    virtual void compute(const input_t& input, context_t& ctx) override;
+    virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
+};
+
+sigmoid_node *sigmoid(node_t *a, const std::string& name = "");
+
+struct tanh_node : public node_t {
+    virtual void compute(const input_t& input, context_t& ctx) override;
+    virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
+};
+
+tanh_node *tanh_tensor(node_t *a, const std::string& name = "");
+
+// The tanh approximation of GELU; see vgelu.
+struct gelu_node : public node_t {
+    virtual void compute(const input_t& input, context_t& ctx) override;
+    virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
+};
+
+gelu_node *gelu(node_t *a, const std::string& name = "");
+
+// Row ids[i] of table as row i of the result, for a [V x D] parameter table
+// and [B x 1] ids holding integers in [0, V). The gradient of the table is
+// row-sparse; ids gets none.
+struct embedding_node : public node_t {
+    virtual void compute(const input_t& input, context_t& ctx) override;
+    virtual void differentiate() override;
+    virtual bool equivalent(const node_t& other) const override;
+};
+
+embedding_node *embedding(node_t *table, node_t *ids,
+                          const std::string& name = "");
+
+// TODO: Convolution
+
+// The values of the nodes of a finalized graph for one forward pass. Values
+// of parameters are shared with the graph and only read; other nodes get
+// buffers of their own, so passes over different contexts of one graph can
+// run at the same time. A context is invalidated by finalizing its graph
+// again.
+struct context_t {
+    graph_t* graph;
+    std::vector<tensor_t> values;
+    std::vector<node_state_t*> states;
+    // Whether values[i] belongs to this context.
+    std::vector<bool> owned;
+    // With sharedp, every value is the value member of its node; graph_t
+    // keeps such a context for training.
+    explicit context_t(graph_t* graph_, bool sharedp = false);
+    context_t(const context_t&) = delete;
+    context_t& operator=(const context_t&) = delete;
+    ~context_t();
+    // The value of u in this context.
+    const tensor_t& value(const node_t* u) const;
+    template <class T>
+    T& state(std::size_t i) {
+        return *static_cast<T*>(states[i]);
+    }
+};
 
 struct graph_t {
     std::vector<node_t*> nodes;
@@ -91,8 +230,40 @@ struct graph_t {
     std::mt19937_64 rng;
     std::uniform_real_distribution<real> uniform_dist;
     std::normal_distribution<real> normal_dist;
+    // Nodes whose values are used after compute. If empty, the last node is
+    // the only output.
+    std::vector<std::size_t> outputs;
+    // Run in order by finalize. Nodes removed by a pass are deleted, so
+    // pointers to them must not be used afterwards; mark_output keeps a node
+    // from being removed, and name_tbl follows nodes that get replaced.
+    std::vector<pass_t*> passes;
+    // When set, finalize benchmarks kernel variants for every node and keeps
+    // the fastest, remembering the choices in the file tuning_cache.
+    bool tune = false;
+    std::string tuning_cache = "tdle_tuning.txt";
+    // Created by finalize, aliasing the value members of the nodes.
+    context_t* context = nullptr;
+    // Set before adding nodes to leave out their gradient buffers; such a
+    // graph can only be computed, not differentiated or trained.
+    bool forward_onlyp = false;
     void finalize();
+    // Computes all values on context, clearing the adjoints for a following
+    // backward pass.
     void compute(const input_t& input);
+    // A forward pass on ctx only. May run on several threads at once with
+    // different contexts.
+    void compute(const input_t& input, context_t& ctx);
+    void mark_output(node_t* u);
+    bool outputp(const node_t* u) const;
+    // Makes every user of u use v instead.
+    void replace(node_t* u, node_t* v);
+    // Detaches u from its dependencies; it is deleted by the next compact.
+    void erase(node_t* u);
+    std::vector<std::size_t> erased;
+    // Deletes erased nodes and renumbers the rest.
+    void compact();
+    // Reorders nodes so that the node at old[i] gets index i.
+    void renumber(const std::vector<std::size_t>& old);
     std::unordered_map<std::string, node_t*> name_tbl;
     placeholder *add_placeholder(const shape_t& shape, const std::string& name);
     parameter *add_parameter(const shape_t& shape, const std::string& name = "");
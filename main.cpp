@@ -1,12 +1,15 @@
 #include <spdlog/spdlog.h>
 
+#include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 
 #include "control_flow.h"
 #include "graph.h"
+#include "metrics.h"
 #include "optimizer.h"
 
 std::vector<uint8_t> read_bytes(const std::string& fn) {
@@ -107,8 +110,7 @@ int main() {
     auto yp = softmax(w3_y2_b3, "yp");
     auto y = g.add_placeholder({l4, 1}, "y");
     auto log_yp = log_tensor(yp, "log_yp");
-    auto log_yp_t = reshape(log_yp, {1, l4});
-    auto neg_loss = multiply(log_yp_t, y, "neg_loss");
+    auto neg_loss = multiply(log_yp, y, true, false, "neg_loss");
     auto loss = multiply(-1, neg_loss, "loss");
     normal_init(w1, sqrt(1.0 / l1));
     zero_init(b1);
@@ -140,6 +142,12 @@ int main() {
                   << std::endl;
     }
 
+    // Metrics are written every 10 s to the file named by TDLE_METRICS, if
+    // set.
+    std::unique_ptr<metrics_exporter> exporter;
+    if (auto path = std::getenv("TDLE_METRICS"))
+        exporter = std::make_unique<metrics_exporter>(
+            path, metrics_format::prometheus, std::chrono::seconds(10));
     int t = 0;
     adam optimizer(&g);
     while (true) {
@@ -0,0 +1,219 @@
+#include "metrics.h"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "control_flow.h"
+#include "graph.h"
+
+static const char* kind_names[metrics_t::kinds] = {
+    "value", "adjoint", "acc", "optimizer_state", "other"};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+double histogram_t::bound(std::size_t i) { return std::ldexp(1e-6, i); }
+
+void histogram_t::record(double seconds) {
+    std::size_t i = 0;
+    while (i < buckets && seconds > bound(i)) i++;
+    counts[i]++;
+    count++;
+    sum += seconds;
+}
+
+void metrics_t::allocate(buffer_kind kind, std::uint64_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bytes[(std::size_t)kind] += size;
+    total_bytes += size;
+    peak_bytes = std::max(peak_bytes, total_bytes);
+}
+
+void metrics_t::release(buffer_kind kind, std::uint64_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bytes[(std::size_t)kind] -= size;
+    total_bytes -= size;
+}
+
+void metrics_t::add_node_bytes(const node_t* u, std::uint64_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [it, inserted] = node_bytes.try_emplace(u);
+    auto& entry = it->second;
+    if (inserted) {
+        entry.graph =
+            graph_ids.try_emplace(u->graph, graph_ids.size()).first->second;
+        entry.index = u->index;
+        entry.name = u->name;
+    }
+    entry.bytes += size;
+}
+
+void metrics_t::relabel_node(const node_t* u) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = node_bytes.find(u);
+    if (it != node_bytes.end()) it->second.index = u->index;
+}
+
+void metrics_t::remove_node(const node_t* u) {
+    std::lock_guard<std::mutex> lock(mutex);
+    node_bytes.erase(u);
+}
+
+void metrics_t::record(histogram_t& histogram, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    histogram.record(seconds);
+}
+
+void metrics_t::record_iter(std::size_t n, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    iter.record(seconds);
+    examples += n;
+    training_seconds += seconds;
+}
+
+// For Prometheus label values, where only these three need escaping.
+static std::string escape(const std::string& s) {
+    std::string ret;
+    for (auto c : s) {
+        if (c == '"' || c == '\\') ret += '\\';
+        if (c == '\n') {
+            ret += "\\n";
+            continue;
+        }
+        ret += c;
+    }
+    return ret;
+}
+
+// For JSON strings, which must not contain raw control characters.
+static std::string json_escape(const std::string& s) {
+    std::string ret;
+    for (auto c : s) {
+        if ((unsigned char)c < 0x20) {
+            char code[7];
+            std::snprintf(code, sizeof code, "\\u%04x", (unsigned char)c);
+            ret += code;
+            continue;
+        }
+        if (c == '"' || c == '\\') ret += '\\';
+        ret += c;
+    }
+    return ret;
+}
+
+std::string metrics_t::prometheus() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ostringstream st;
+    st << "# TYPE tdle_tensor_bytes gauge\n";
+    for (std::size_t k = 0; k < kinds; k++)
+        st << "tdle_tensor_bytes{kind=\"" << kind_names[k] << "\"} "
+           << bytes[k] << "\n";
+    st << "# TYPE tdle_tensor_peak_bytes gauge\n"
+       << "tdle_tensor_peak_bytes " << peak_bytes << "\n";
+    st << "# TYPE tdle_node_bytes gauge\n";
+    for (const auto& [u, entry] : node_bytes)
+        st << "tdle_node_bytes{graph=\"" << entry.graph << "\",index=\""
+           << entry.index << "\",node=\"" << escape(entry.name) << "\"} "
+           << entry.bytes << "\n";
+    auto histogram = [&](const std::string& name, const histogram_t& h) {
+        st << "# TYPE " << name << " histogram\n";
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < histogram_t::buckets; i++) {
+            cumulative += h.counts[i];
+            st << name << "_bucket{le=\"" << histogram_t::bound(i) << "\"} "
+               << cumulative << "\n";
+        }
+        st << name << "_bucket{le=\"+Inf\"} " << h.count << "\n"
+           << name << "_sum " << h.sum << "\n"
+           << name << "_count " << h.count << "\n";
+    };
+    histogram("tdle_compute_seconds", compute);
+    histogram("tdle_differentiate_seconds", differentiate);
+    histogram("tdle_iter_seconds", iter);
+    st << "# TYPE tdle_examples_total counter\n"
+       << "tdle_examples_total " << examples << "\n"
+       << "# TYPE tdle_examples_per_second gauge\n"
+       << "tdle_examples_per_second "
+       << (training_seconds > 0 ? examples / training_seconds : 0) << "\n";
+    return st.str();
+}
+
+std::string metrics_t::json() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ostringstream st;
+    st << "{\"tensor_bytes\":{";
+    for (std::size_t k = 0; k < kinds; k++)
+        st << (k ? "," : "") << "\"" << kind_names[k] << "\":" << bytes[k];
+    st << "},\"tensor_peak_bytes\":" << peak_bytes << ",\"node_bytes\":[";
+    bool first = true;
+    for (const auto& [u, entry] : node_bytes) {
+        st << (first ? "" : ",") << "{\"graph\":" << entry.graph
+           << ",\"index\":" << entry.index << ",\"node\":\""
+           << json_escape(entry.name) << "\",\"bytes\":" << entry.bytes << "}";
+        first = false;
+    }
+    st << "]";
+    auto histogram = [&](const std::string& name, const histogram_t& h) {
+        st << ",\"" << name << "\":{\"bounds\":[";
+        for (std::size_t i = 0; i < histogram_t::buckets; i++)
+            st << (i ? "," : "") << histogram_t::bound(i);
+        st << "],\"counts\":[";
+        for (std::size_t i = 0; i <= histogram_t::buckets; i++)
+            st << (i ? "," : "") << h.counts[i];
+        st << "],\"sum\":" << h.sum << ",\"count\":" << h.count << "}";
+    };
+    histogram("compute_seconds", compute);
+    histogram("differentiate_seconds", differentiate);
+    histogram("iter_seconds", iter);
+    st << ",\"examples\":" << examples << ",\"examples_per_second\":"
+       << (training_seconds > 0 ? examples / training_seconds : 0) << "}\n";
+    return st.str();
+}
+
+metrics_t& metrics() {
+    // Never destroyed, so tensors freed during static destruction can still
+    // be accounted for.
+    static auto m = new metrics_t;
+    return *m;
+}
+
+void write_metrics(const std::string& path, metrics_format format) {
+    auto snapshot = format == metrics_format::json ? metrics().json()
+                                                   : metrics().prometheus();
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream st(tmp);
+        if (!st) PANIC("Cannot write metrics to {}", tmp);
+        st << snapshot;
+    }
+    if (std::rename(tmp.c_str(), path.c_str()))
+        PANIC("Cannot replace metrics file {}", path);
+}
+
+metrics_exporter::metrics_exporter(const std::string& path_,
+                                   metrics_format format_,
+                                   std::chrono::milliseconds period_) {
+    path = path_;
+    format = format_;
+    period = period_;
+    worker = std::thread([this] {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(lock, period, [this] { return stop; }))
+            write_metrics(path, format);
+    });
+}
+
+metrics_exporter::~metrics_exporter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+    write_metrics(path, format);
+}
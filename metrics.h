@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "tensor.h"
+
+struct graph_t;
+struct node_t;
+
+double seconds_since(std::chrono::steady_clock::time_point start);
+
+// Latency histogram with bucket bounds 1us, 2us, 4us, ... and an overflow
+// bucket, as exported to Prometheus.
+struct histogram_t {
+    static constexpr std::size_t buckets = 28;
+    std::array<std::uint64_t, buckets + 1> counts{};
+    std::uint64_t count = 0;
+    double sum = 0;
+    static double bound(std::size_t i);
+    void record(double seconds);
+};
+
+// Process-wide runtime metrics. All members are guarded by mutex; use the
+// methods, which lock it, or hold it while reading.
+struct metrics_t {
+    std::mutex mutex;
+    static constexpr std::size_t kinds = 5;
+    // Bytes currently allocated by new_tensor, per buffer_kind.
+    std::array<std::uint64_t, kinds> bytes{};
+    std::uint64_t total_bytes = 0, peak_bytes = 0;
+    // Bytes owned by each live node, labelled by its graph, index and name.
+    // Graphs are numbered in the order their first node is seen.
+    struct node_entry_t {
+        std::size_t graph, index;
+        std::string name;
+        std::uint64_t bytes = 0;
+    };
+    std::unordered_map<const node_t*, node_entry_t> node_bytes;
+    std::unordered_map<const graph_t*, std::size_t> graph_ids;
+    // graph_t::compute, the backward pass over one example and a whole
+    // optimizer iteration.
+    histogram_t compute, differentiate, iter;
+    std::uint64_t examples = 0;
+    double training_seconds = 0;
+
+    void allocate(buffer_kind kind, std::uint64_t size);
+    void release(buffer_kind kind, std::uint64_t size);
+    void add_node_bytes(const node_t* u, std::uint64_t size);
+    // Updates the index of u after its graph has been renumbered.
+    void relabel_node(const node_t* u);
+    void remove_node(const node_t* u);
+    void record(histogram_t& histogram, double seconds);
+    void record_iter(std::size_t examples, double seconds);
+    std::string prometheus();
+    std::string json();
+};
+
+metrics_t& metrics();
+
+enum class metrics_format { prometheus, json };
+
+// Writes a snapshot of metrics(), replacing the file atomically.
+void write_metrics(const std::string& path, metrics_format format);
+
+// Writes a snapshot every period on a background thread until destroyed.
+struct metrics_exporter {
+    std::string path;
+    metrics_format format;
+    std::chrono::milliseconds period;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+    std::thread worker;
+    metrics_exporter(const std::string& path_, metrics_format format_,
+                     std::chrono::milliseconds period_);
+    ~metrics_exporter();
+};
@@ -2,9 +2,11 @@
 
 #include <spdlog/spdlog.h>
 
+#include <chrono>
 #include <iostream>
 
 #include "control_flow.h"
+#include "metrics.h"
 
 void print_matrix(std::ostream& st, tensor_t t) {
     if (t.shape.size() != 2) PANIC("Not a matrix");
@@ -22,13 +24,46 @@ void print_matrix_transposed(std::ostream& st, tensor_t t) {
     }
 }
 
-void sgd::iter(std::size_t t, const std::vector<input_t>& training_set,
-               real learning_rate) {
+// u as a parameter with row-sparse gradients, or nullptr.
+static parameter* sparse(node_t* u) {
+    auto p = dynamic_cast<parameter*>(u);
+    return p && p->sparse_gradp ? p : nullptr;
+}
+
+// Calls f(j) for the elements of the rows of sparse parameter p that have
+// a nonzero acc.
+template <class F>
+static void for_each_sparse(parameter* p, F f) {
+    auto width = p->value.shape[1];
+    for (auto r : p->acc_rows.rows)
+        for (std::size_t j = r * width; j < (r + 1) * width; j++) f(j);
+}
+
+// Sums the adjoints over training_set into acc and returns the number of
+// examples. With data parallelism, the sums and the count are over all ranks,
+// and each parameter is handed over for reduction as soon as its last
+// adjoint is final.
+static std::size_t accumulate(graph_t* g,
+                              const std::vector<input_t>& training_set,
+                              data_parallel* parallel) {
     if (shape_to_size((*(g->nodes.rbegin()))->value.shape) != 1)
         PANIC("The last node of graph is not a scalar");
+    if (g->forward_onlyp) PANIC("Training a forward-only graph");
     // spdlog::info("cleared adjoint");
     for (std::size_t i = 0; i < g->nodes.size(); i++) {
         auto& u = *(g->nodes[i]);
+        if (auto p = sparse(&u)) {
+            if (parallel)
+                PANIC("Sparse gradients of {} are not supported with data "
+                      "parallelism",
+                      u.name);
+            auto width = u.value.shape[1];
+            for (auto r : p->acc_rows.rows)
+                std::fill(u.acc.data + r * width, u.acc.data + (r + 1) * width,
+                          0);
+            p->acc_rows.clear();
+            continue;
+        }
         auto size = shape_to_size(u.value.shape);
         for (std::size_t j = 0; j < size; j++) {
             u.acc.data[j] = 0;
@@ -37,29 +72,72 @@ void sgd::iter(std::size_t t, const std::vector<input_t>& training_set,
     std::size_t selected = 0;
     for (const auto& example : training_set) {
         selected++;
+        bool last = parallel && selected == training_set.size();
         // spdlog::info("selected {} for now", selected);
         g->compute(example);
+        auto start = std::chrono::steady_clock::now();
         *((*g->nodes.rbegin())->adjoint.data) = 1;
         for (auto it = g->order.rbegin(); it != g->order.rend(); it++) {
             auto& u = *(g->nodes[*it]);
             u.differentiate();
+            // Every successor of u has been differentiated.
+            if (last && u.parameterp) {
+                auto size = shape_to_size(u.value.shape);
+                for (std::size_t j = 0; j < size; j++) {
+                    u.acc.data[j] += u.adjoint.data[j];
+                }
+                parallel->ready(&u);
+            }
         }
+        auto& stats = metrics();
+        stats.record(stats.differentiate, seconds_since(start));
         for (std::size_t i = 0; i < g->nodes.size(); i++) {
             auto& u = *(g->nodes[i]);
+            if (last && u.parameterp) continue;
+            if (auto p = sparse(&u)) {
+                auto width = u.value.shape[1];
+                for (auto r : p->adjoint_rows.rows) {
+                    p->acc_rows.mark(r);
+                    for (std::size_t j = r * width; j < (r + 1) * width; j++)
+                        u.acc.data[j] += u.adjoint.data[j];
+                }
+                continue;
+            }
             auto size = shape_to_size(u.value.shape);
             for (std::size_t j = 0; j < size; j++) {
                 u.acc.data[j] += u.adjoint.data[j];
             }
         }
     }
+    // Without examples of its own, a rank still takes part in every
+    // reduction, with zero gradients.
+    if (parallel && training_set.empty())
+        for (auto it = g->order.rbegin(); it != g->order.rend(); it++)
+            if (g->nodes[*it]->parameterp) parallel->ready(g->nodes[*it]);
+    if (parallel) return parallel->finish(selected);
+    return selected;
+}
+
+void sgd::iter(std::size_t t, const std::vector<input_t>& training_set,
+               real learning_rate) {
+    auto start = std::chrono::steady_clock::now();
+    auto selected = accumulate(g, training_set, parallel);
     for (std::size_t i = 0; i < g->nodes.size(); i++) {
         if (!g->nodes[i]->parameterp) continue;
         auto& u = *(g->nodes[i]);
+        auto update = [&](std::size_t j) {
+            u.value.data[j] -= learning_rate * u.acc.data[j] / selected;
+        };
+        if (auto p = sparse(&u)) {
+            for_each_sparse(p, update);
+            continue;
+        }
         auto size = shape_to_size(u.value.shape);
         for (std::size_t j = 0; j < size; j++) {
-            u.value.data[j] -= learning_rate * u.acc.data[j] / selected;
+            update(j);
         }
     }
+    metrics().record_iter(training_set.size(), seconds_since(start));
 }
 
 adam::adam(graph_t* g_, real b1_, real b2_, real e_) {
@@ -68,13 +146,12 @@ adam::adam(graph_t* g_, real b1_, real b2_, real e_) {
     b2 = b2_;
     e = e_;
     for (std::size_t i = 0; i < g->nodes.size(); i++) {
-        if (g->nodes[i]->parameterp) {
-            m.push_back(new_tensor(g->nodes[i]->value.shape));
-            v.push_back(new_tensor(g->nodes[i]->value.shape));
-        } else {
-            m.push_back(new_tensor({1}));
-            v.push_back(new_tensor({1}));
-        }
+        auto shape = g->nodes[i]->parameterp ? g->nodes[i]->value.shape
+                                             : shape_t{1};
+        m.push_back(new_tensor(shape, buffer_kind::optimizer_state));
+        v.push_back(new_tensor(shape, buffer_kind::optimizer_state));
+        metrics().add_node_bytes(g->nodes[i],
+                                 2 * shape_to_size(shape) * sizeof(real));
         zero_init(*m.rbegin());
         zero_init(*v.rbegin());
     }
@@ -82,37 +159,17 @@ adam::adam(graph_t* g_, real b1_, real b2_, real e_) {
 
 void adam::iter(std::size_t t, const std::vector<input_t>& training_set,
                 real learning_rate) {
-    if (shape_to_size((*(g->nodes.rbegin()))->value.shape) != 1)
-        PANIC("The last node of graph is not a scalar");
-    // spdlog::info("cleared adjoint");
-    for (std::size_t i = 0; i < g->nodes.size(); i++) {
-        auto& u = *(g->nodes[i]);
-        auto size = shape_to_size(u.value.shape);
-        for (std::size_t j = 0; j < size; j++) {
-            u.acc.data[j] = 0;
-        }
-    }
-    std::size_t selected = 0;
-    for (const auto& example : training_set) {
-        selected++;
-        // spdlog::info("selected {} for now", selected);
-        g->compute(example);
-        *((*g->nodes.rbegin())->adjoint.data) = 1;
-        for (auto it = g->order.rbegin(); it != g->order.rend(); it++) {
-            auto& u = *(g->nodes[*it]);
-            u.differentiate();
-        }
-        for (std::size_t i = 0; i < g->nodes.size(); i++) {
-            auto& u = *(g->nodes[i]);
-            auto size = shape_to_size(u.value.shape);
-            for (std::size_t j = 0; j < size; j++) {
-                u.acc.data[j] += u.adjoint.data[j];
-            }
-        }
-    }
+    auto start = std::chrono::steady_clock::now();
+    auto selected = accumulate(g, training_set, parallel);
+    // Rows of sparse parameters without a gradient in this iteration keep
+    // their moments and values, as in lazy Adam.
     for (std::size_t i = 0; i < g->nodes.size(); i++) {
         if (!g->nodes[i]->parameterp) continue;
         auto& u = *(g->nodes[i]);
+        if (auto p = sparse(&u)) {
+            for_each_sparse(p, [&](std::size_t j) { u.acc.data[j] /= selected; });
+            continue;
+        }
         auto size = shape_to_size(u.value.shape);
         for (std::size_t j = 0; j < size; j++) {
             u.acc.data[j] /= selected;
@@ -122,13 +179,21 @@ void adam::iter(std::size_t t, const std::vector<input_t>& training_set,
     for (std::size_t i = 0; i < g->nodes.size(); i++) {
         if (!g->nodes[i]->parameterp) continue;
         auto& u = *(g->nodes[i]);
-        auto size = shape_to_size(u.value.shape);
-        for (std::size_t j = 0; j < size; j++) {
+        auto update = [&](std::size_t j) {
             m[i].data[j] = b1 * m[i].data[j] + (1 - b1) * u.acc.data[j];
             v[i].data[j] =
                 b2 * v[i].data[j] + (1 - b2) * u.acc.data[j] * u.acc.data[j];
             u.value.data[j] -= learning_rate * m[i].data[j] / (1 - pow(b1, t)) /
                                (e + sqrt(v[i].data[j] / (1 - pow(b2, t))));
+        };
+        if (auto p = sparse(&u)) {
+            for_each_sparse(p, update);
+            continue;
+        }
+        auto size = shape_to_size(u.value.shape);
+        for (std::size_t j = 0; j < size; j++) {
+            update(j);
         }
     }
+    metrics().record_iter(training_set.size(), seconds_since(start));
 }
@@ -5,9 +5,12 @@
 #include <vector>
 
 #include "config.h"
+#include "distributed.h"
 #include "graph.h"
 
 struct optimizer {
+    // When set, gradients are summed over all ranks before each update.
+    data_parallel* parallel = nullptr;
     virtual void iter(std::size_t t, const std::vector<input_t>& training_set,
                       real learning_rate) = 0;
 };
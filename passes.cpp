@@ -0,0 +1,135 @@
+#include "passes.h"
+
+#include <algorithm>
+#include <map>
+
+#include "control_flow.h"
+
+// The name of u for logging.
+static std::string label(const node_t* u) {
+    return u->name.empty() ? "#" + std::to_string(u->index) : u->name;
+}
+
+std::string dead_node_elimination::name() const {
+    return "dead node elimination";
+}
+
+std::size_t dead_node_elimination::run(graph_t* g) {
+    std::vector<bool> live(g->size(), false);
+    std::vector<std::size_t> stack;
+    for (std::size_t i = 0; i < g->size(); i++)
+        if (g->outputp(g->nodes[i])) stack.push_back(i);
+    while (!stack.empty()) {
+        auto i = stack.back();
+        stack.pop_back();
+        if (live[i]) continue;
+        live[i] = true;
+        for (auto d : g->nodes[i]->dependencies) stack.push_back(d);
+    }
+    // Successors are erased before their dependencies.
+    std::size_t changes = 0;
+    for (std::size_t i = g->size(); i-- > 0;) {
+        if (live[i]) continue;
+        spdlog::info("Removed unused node {}", label(g->nodes[i]));
+        g->erase(g->nodes[i]);
+        changes++;
+    }
+    return changes;
+}
+
+std::string common_subexpression_elimination::name() const {
+    return "common subexpression elimination";
+}
+
+std::size_t common_subexpression_elimination::run(graph_t* g) {
+    // Dependencies come before their successors, so by the time a node is
+    // visited its dependencies have already been merged.
+    std::map<std::vector<std::size_t>, std::vector<node_t*>> seen;
+    std::size_t changes = 0;
+    for (std::size_t i = 0; i < g->size(); i++) {
+        auto u = g->nodes[i];
+        if (u->dependencies.empty()) continue;
+        auto key = u->dependencies;
+        // The order of operands does not matter for commutative nodes.
+        if (dynamic_cast<addition*>(u)) std::sort(key.begin(), key.end());
+        auto& candidates = seen[key];
+        node_t* same = nullptr;
+        for (auto v : candidates) {
+            if (v->value.shape == u->value.shape && v->equivalent(*u)) {
+                same = v;
+                break;
+            }
+        }
+        // Outputs are kept, as the node taking over an output may have other
+        // users, which would keep the loss from being the last node.
+        if (!same || g->outputp(u)) {
+            candidates.push_back(u);
+            continue;
+        }
+        spdlog::info("Merged node {} into {}", label(u), label(same));
+        g->replace(u, same);
+        g->erase(u);
+        changes++;
+    }
+    return changes;
+}
+
+std::string algebraic_simplification::name() const {
+    return "algebraic simplification";
+}
+
+// Drops u, which no longer has successors, unless its value is used.
+static void erase_unused(graph_t* g, node_t* u) {
+    if (u->successors.empty() && !g->outputp(u)) g->erase(u);
+}
+
+std::size_t algebraic_simplification::run(graph_t* g) {
+    std::size_t changes = 0;
+    for (std::size_t i = 0; i < g->size(); i++) {
+        auto u = g->nodes[i];
+        if (u->dependencies.empty()) continue;
+        auto d = g->nodes[u->dependencies[0]];
+        if (auto r = dynamic_cast<reshape_node*>(u)) {
+            if (dynamic_cast<reshape_node*>(d)) {
+                auto x = g->nodes[d->dependencies[0]];
+                auto& succ = d->successors;
+                succ.erase(std::find(succ.begin(), succ.end(), r->index));
+                r->dependencies[0] = x->index;
+                x->successors.push_back(r->index);
+                spdlog::info("Collapsed reshape {} into {}", label(d), label(r));
+                erase_unused(g, d);
+                d = x;
+                changes++;
+            }
+            if (r->value.shape == d->value.shape && !g->outputp(r)) {
+                spdlog::info("Removed reshape {} to the same shape", label(r));
+                g->replace(r, d);
+                g->erase(r);
+                changes++;
+            }
+        } else if (auto s = dynamic_cast<scalar_multiplication*>(u)) {
+            if (s->a == 1 && !g->outputp(s)) {
+                spdlog::info("Removed multiplication {} by 1", label(s));
+                g->replace(s, d);
+                g->erase(s);
+                changes++;
+                continue;
+            }
+            if (d->successors.size() != 1 || g->outputp(d) || g->outputp(s))
+                continue;
+            if (auto p = dynamic_cast<multiplication*>(d)) {
+                p->alpha *= s->a;
+            } else if (auto t = dynamic_cast<scalar_multiplication*>(d)) {
+                t->a *= s->a;
+            } else {
+                continue;
+            }
+            spdlog::info("Folded scalar multiplication {} into {}", label(s),
+                         label(d));
+            g->replace(s, d);
+            g->erase(s);
+            changes++;
+        }
+    }
+    return changes;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+#include "graph.h"
+
+// A rewrite of a graph run by graph_t::finalize before the evaluation order
+// is computed. Passes rewire nodes with graph_t::replace and drop them with
+// graph_t::erase; outputs and the last node must keep their values.
+struct pass_t {
+    virtual ~pass_t() = default;
+    virtual std::string name() const = 0;
+    // Returns the number of changes made.
+    virtual std::size_t run(graph_t* g) = 0;
+};
+
+// Removes nodes that no output depends on.
+struct dead_node_elimination : public pass_t {
+    virtual std::string name() const override;
+    virtual std::size_t run(graph_t* g) override;
+};
+
+// Merges equivalent nodes with the same dependencies, in any order for
+// additions. Outputs are never merged away.
+struct common_subexpression_elimination : public pass_t {
+    virtual std::string name() const override;
+    virtual std::size_t run(graph_t* g) override;
+};
+
+// Folds scalar multiplications into the multiplication or scalar
+// multiplication before them, collapses chains of reshapes, and removes
+// reshapes to the same shape and multiplications by 1. Outputs are never
+// folded or removed.
+struct algebraic_simplification : public pass_t {
+    virtual std::string name() const override;
+    virtual std::size_t run(graph_t* g) override;
+};
@@ -0,0 +1,305 @@
+#include "quantize.h"
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "control_flow.h"
+#include "fused.h"
+#include "runtime.h"
+
+// All kernels compute the dot product of unsigned activations (int8 values
+// offset by 128, as VNNI requires) with signed weights; the offset is removed
+// afterwards using the row sums of the weights.
+using dot_kernel_t = int32_t (*)(const uint8_t*, const int8_t*, std::size_t);
+
+static int32_t dot_scalar(const uint8_t* u, const int8_t* w, std::size_t m) {
+    int32_t sum = 0;
+    for (std::size_t j = 0; j < m; j++) sum += (int32_t)u[j] * w[j];
+    return sum;
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2"))) static int32_t hsum(__m256i v) {
+    auto s = _mm_add_epi32(_mm256_castsi256_si128(v),
+                           _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2"))) static int32_t dot_avx2(const uint8_t* u,
+                                                        const int8_t* w,
+                                                        std::size_t m) {
+    auto acc = _mm256_setzero_si256();
+    std::size_t j = 0;
+    for (; j + 16 <= m; j += 16) {
+        auto a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(u + j)));
+        auto b = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w + j)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+    }
+    return hsum(acc) + dot_scalar(u + j, w + j, m - j);
+}
+
+__attribute__((target("avx512f,avx512vnni"))) static int32_t dot_vnni512(
+    const uint8_t* u, const int8_t* w, std::size_t m) {
+    auto acc = _mm512_setzero_si512();
+    std::size_t j = 0;
+    for (; j + 64 <= m; j += 64) {
+        acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(u + j),
+                                  _mm512_loadu_si512(w + j));
+    }
+    alignas(64) int32_t lanes[16];
+    _mm512_store_si512(lanes, acc);
+    int32_t sum = 0;
+    for (auto x : lanes) sum += x;
+    return sum + dot_scalar(u + j, w + j, m - j);
+}
+
+__attribute__((target("avx2,avxvnni"))) static int32_t dot_vnni(
+    const uint8_t* u, const int8_t* w, std::size_t m) {
+    auto acc = _mm256_setzero_si256();
+    std::size_t j = 0;
+    for (; j + 32 <= m; j += 32) {
+        acc = _mm256_dpbusd_avx_epi32(
+            acc, _mm256_loadu_si256((const __m256i*)(u + j)),
+            _mm256_loadu_si256((const __m256i*)(w + j)));
+    }
+    return hsum(acc) + dot_scalar(u + j, w + j, m - j);
+}
+#endif
+
+static dot_kernel_t select_dot_kernel() {
+#ifdef __x86_64__
+    // Servers have AVX512-VNNI, client CPUs the VEX encoded AVX-VNNI.
+    if (__builtin_cpu_supports("avx512vnni")) return dot_vnni512;
+    if (__builtin_cpu_supports("avxvnni")) return dot_vnni;
+    if (__builtin_cpu_supports("avx2")) return dot_avx2;
+#endif
+    return dot_scalar;
+}
+
+static const dot_kernel_t dot_kernel = select_dot_kernel();
+
+static int8_t quantize_value(real x, real scale) {
+    auto q = std::lround(x / scale);
+    return (int8_t)std::clamp(q, -127l, 127l);
+}
+
+node_state_t* quantized_multiplication::new_state() const {
+    auto s = new state_t;
+    s->input_q.resize(m * l);
+    return s;
+}
+
+void quantized_multiplication::compute(const input_t& input, context_t& ctx) {
+    auto& x = ctx.values[dependencies[0]];
+    auto& y = ctx.values[index];
+    auto& input_q = ctx.state<state_t>(index).input_q;
+    for (std::size_t j = 0; j < m; j++)
+        for (std::size_t k = 0; k < l; k++)
+            input_q[k * m + j] =
+                quantize_value(x.data[j * l + k], input_scale) + 128;
+    parallel_for(n, grain_for(m * l), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            auto scale = weight_scale[i] * input_scale;
+            for (std::size_t k = 0; k < l; k++) {
+                auto acc = dot_kernel(input_q.data() + k * m,
+                                      weight.data() + i * m, m) -
+                           128 * weight_sum[i];
+                auto v = scale * acc;
+                if (biasp) v += ctx.values[dependencies[1]].data[i * l + k];
+                if (relup) v = std::max((real)0, v);
+                y.data[i * l + k] = v;
+            }
+        }
+    });
+}
+
+void quantized_multiplication::differentiate() {
+    PANIC("Quantized node {} does not support differentiation", name);
+}
+
+static real max_abs(const tensor_t& t) {
+    auto size = shape_to_size(t.shape);
+    real ret = 0;
+    for (std::size_t i = 0; i < size; i++) ret = std::max(ret, std::abs(t.data[i]));
+    return ret;
+}
+
+static quantized_multiplication* add_quantized(node_t* w, node_t* x,
+                                               node_t* bias, bool relup,
+                                               real input_max,
+                                               const std::string& name) {
+    auto u = new quantized_multiplication;
+    u->n = w->value.shape[0];
+    u->m = w->value.shape[1];
+    u->l = x->value.shape[1];
+    u->weight.resize(u->n * u->m);
+    u->weight_sum.resize(u->n);
+    u->weight_scale.resize(u->n);
+    for (std::size_t i = 0; i < u->n; i++) {
+        real row_max = 0;
+        for (std::size_t j = 0; j < u->m; j++)
+            row_max = std::max(row_max, std::abs(w->value.data[i * u->m + j]));
+        u->weight_scale[i] = row_max > 0 ? row_max / 127 : 1;
+        u->weight_sum[i] = 0;
+        for (std::size_t j = 0; j < u->m; j++) {
+            auto q = quantize_value(w->value.data[i * u->m + j],
+                                    u->weight_scale[i]);
+            u->weight[i * u->m + j] = q;
+            u->weight_sum[i] += q;
+        }
+    }
+    u->input_scale = input_max > 0 ? input_max / 127 : 1;
+    u->biasp = bias != nullptr;
+    u->relup = relup;
+
+    auto i = x->graph->nodes.size();
+    shape_t shape{u->n, u->l};
+    u->dependencies = {x->index};
+    x->successors.push_back(i);
+    if (bias) {
+        u->dependencies.push_back(bias->index);
+        bias->successors.push_back(i);
+    }
+    u->index = i;
+    u->name = name;
+    u->graph = x->graph;
+    allocate_buffers(u, shape);
+    u->parameterp = false;
+    u->graph->nodes.push_back(u);
+    u->graph->name_tbl[name] = u;
+    return u;
+}
+
+graph_t* quantize(graph_t* g, const std::vector<input_t>& calibration_set) {
+    if (calibration_set.empty())
+        PANIC("Quantization needs at least one calibration input");
+    auto size = g->size();
+    // head[i]: the quantized multiplication starting the chain that node i
+    // belongs to, tail[i]: the last node of the chain starting at node i.
+    std::vector<std::size_t> head(size, size), tail(size, size);
+    std::vector<node_t*> bias(size, nullptr);
+    std::vector<bool> relup(size, false);
+    for (std::size_t i = 0; i < size; i++) {
+        auto u = g->nodes[i];
+        auto p = dynamic_cast<multiplication*>(u);
+        if (!p || p->alpha != 1 || p->transpose_a || p->transpose_b) continue;
+        auto w = g->nodes[u->dependencies[0]];
+        if (!w->parameterp) continue;
+        head[i] = tail[i] = i;
+        // Values of outputs are kept, so chains end at them.
+        auto v = u;
+        if (!g->outputp(v) && v->successors.size() == 1 &&
+            dynamic_cast<addition*>(g->nodes[v->successors[0]])) {
+            auto s = g->nodes[v->successors[0]];
+            auto other = g->nodes[s->dependencies[0] == v->index
+                                      ? s->dependencies[1]
+                                      : s->dependencies[0]];
+            if (other->parameterp && other != v) {
+                bias[i] = other;
+                head[s->index] = i;
+                tail[i] = s->index;
+                v = s;
+            }
+        }
+        if (!g->outputp(v) && v->successors.size() == 1 &&
+            dynamic_cast<relu_node*>(g->nodes[v->successors[0]])) {
+            auto s = g->nodes[v->successors[0]];
+            relup[i] = true;
+            head[s->index] = i;
+            tail[i] = s->index;
+        }
+    }
+
+    std::vector<real> input_max(size, 0);
+    for (const auto& example : calibration_set) {
+        g->compute(example);
+        for (std::size_t i = 0; i < size; i++) {
+            if (tail[i] == size) continue;
+            auto x = g->nodes[g->nodes[i]->dependencies[1]];
+            input_max[i] = std::max(input_max[i], max_abs(x->value));
+        }
+    }
+
+    // Weights only feeding quantized nodes are not copied.
+    std::vector<bool> needed(size, false);
+    for (std::size_t i = 0; i < size; i++) {
+        auto u = g->nodes[i];
+        if (head[i] != size) {
+            if (head[i] != i) continue;
+            needed[u->dependencies[1]] = true;
+            if (bias[i]) needed[bias[i]->index] = true;
+        } else {
+            for (auto d : u->dependencies) needed[d] = true;
+        }
+    }
+    needed[size - 1] = true;
+    for (auto o : g->outputs) needed[o] = true;
+
+    auto q = new graph_t;
+    q->forward_onlyp = true;
+    q->rng = g->rng;
+    std::vector<node_t*> map(size, nullptr);
+    for (std::size_t i = 0; i < size; i++) {
+        auto u = g->nodes[i];
+        if (head[i] != size) {
+            auto h = head[i];
+            if (tail[h] != i) continue;
+            auto x = map[g->nodes[h]->dependencies[1]];
+            auto b = bias[h] ? map[bias[h]->index] : nullptr;
+            map[i] = add_quantized(g->nodes[g->nodes[h]->dependencies[0]], x,
+                                   b, relup[h], input_max[h], u->name);
+            continue;
+        }
+        std::vector<node_t*> deps;
+        for (auto d : u->dependencies) deps.push_back(map[d]);
+        if (dynamic_cast<placeholder*>(u)) {
+            map[i] = q->add_placeholder(u->value.shape, u->name);
+        } else if (dynamic_cast<parameter*>(u)) {
+            if (!needed[i]) continue;
+            map[i] = q->add_parameter(u->value.shape, u->name);
+            std::copy(u->value.data,
+                      u->value.data + shape_to_size(u->value.shape),
+                      map[i]->value.data);
+        } else if (auto p = dynamic_cast<multiplication*>(u)) {
+            auto v = multiply(deps[0], deps[1], p->transpose_a,
+                              p->transpose_b, u->name);
+            v->alpha = p->alpha;
+            map[i] = v;
+        } else if (dynamic_cast<addition*>(u)) {
+            map[i] = add(deps[0], deps[1], u->name);
+        } else if (dynamic_cast<log_node*>(u)) {
+            map[i] = log_tensor(deps[0], u->name);
+        } else if (dynamic_cast<reshape_node*>(u)) {
+            map[i] = reshape(deps[0], u->value.shape, u->name);
+        } else if (dynamic_cast<relu_node*>(u)) {
+            map[i] = relu(deps[0], u->name);
+        } else if (dynamic_cast<softmax_node*>(u)) {
+            map[i] = softmax(deps[0], u->name);
+        } else if (dynamic_cast<sigmoid_node*>(u)) {
+            map[i] = sigmoid(deps[0], u->name);
+        } else if (dynamic_cast<tanh_node*>(u)) {
+            map[i] = tanh_tensor(deps[0], u->name);
+        } else if (dynamic_cast<gelu_node*>(u)) {
+            map[i] = gelu(deps[0], u->name);
+        } else if (dynamic_cast<embedding_node*>(u)) {
+            map[i] = embedding(deps[0], deps[1], u->name);
+        } else if (auto f = dynamic_cast<fused_node_base*>(u)) {
+            map[i] = f->rebuild(deps.data(), u->name);
+        } else if (auto s = dynamic_cast<scalar_multiplication*>(u)) {
+            map[i] = multiply(s->a, deps[0], u->name);
+        } else {
+            PANIC("Node {} cannot be quantized", u->name);
+        }
+    }
+    for (auto o : g->outputs) q->mark_output(map[o]);
+    q->finalize();
+    spdlog::info("Quantized graph has {} nodes, original graph has {}",
+                 q->size(), size);
+    return q;
+}
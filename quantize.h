@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "graph.h"
+
+// Forward-only replacement for multiply(w, x) (optionally followed by a bias
+// add and a relu) where w is a parameter. Weights are int8 with one scale per
+// output row, activations are int8 with one calibrated scale per tensor, and
+// products are accumulated in int32.
+struct quantized_multiplication : public node_t {
+    std::size_t n, m, l;
+    std::vector<int8_t> weight;
+    std::vector<int32_t> weight_sum;
+    std::vector<real> weight_scale;
+    real input_scale;
+    bool biasp, relup;
+    // The input, quantized and transposed.
+    struct state_t : public node_state_t {
+        std::vector<uint8_t> input_q;
+    };
+    virtual void compute(const input_t& input, context_t& ctx) override;
+    virtual void differentiate() override;
+    virtual node_state_t* new_state() const override;
+};
+
+// Builds a new graph computing the same function as g, with every
+// parameter-by-activation multiplication (and a bias add and relu directly
+// following it) replaced by a quantized_multiplication. Activation scales are
+// calibrated by running g on calibration_set. Outputs of g stay outputs. The
+// result is forward-only, so it can only be used with graph_t::compute.
+graph_t* quantize(graph_t* g, const std::vector<input_t>& calibration_set);
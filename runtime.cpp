@@ -0,0 +1,154 @@
+#include "runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "control_flow.h"
+
+namespace {
+
+struct job_t {
+    const std::function<void(std::size_t, std::size_t)>* f;
+    std::size_t n, chunk, chunks;
+    std::atomic<std::size_t> next{0}, done{0};
+};
+
+thread_local bool in_kernel = false;
+
+struct thread_pool {
+    std::size_t threads;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_cv, done_cv;
+    std::deque<std::shared_ptr<job_t>> jobs;
+    bool stop = false;
+
+    thread_pool(const runtime_config& config) {
+        threads = config.threads ? config.threads
+                                 : std::max(1u, std::thread::hardware_concurrency());
+        for (std::size_t i = 0; i + 1 < threads; i++) {
+            workers.emplace_back([this] { work(); });
+#ifdef __linux__
+            if (!config.cpus.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(config.cpus[i % config.cpus.size()], &set);
+                if (pthread_setaffinity_np(workers.back().native_handle(),
+                                           sizeof(set), &set))
+                    spdlog::warn("Failed to pin worker {} to cpu {}", i,
+                                 config.cpus[i % config.cpus.size()]);
+            }
+#endif
+        }
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        work_cv.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    // Runs chunks of the job until none are left to claim.
+    void run(job_t& job) {
+        in_kernel = true;
+        std::size_t c;
+        while ((c = job.next++) < job.chunks) {
+            auto begin = c * job.chunk;
+            (*job.f)(begin, std::min(job.n, begin + job.chunk));
+            if (++job.done == job.chunks) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done_cv.notify_all();
+            }
+        }
+        in_kernel = false;
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_cv.wait(lock, [this] { return stop || !jobs.empty(); });
+            if (stop) return;
+            auto job = jobs.front();
+            lock.unlock();
+            run(*job);
+            lock.lock();
+            // Every chunk is claimed, so the job can leave the queue.
+            auto it = std::find(jobs.begin(), jobs.end(), job);
+            if (it != jobs.end()) jobs.erase(it);
+        }
+    }
+
+    void submit(const std::shared_ptr<job_t>& job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(job);
+        }
+        work_cv.notify_all();
+        run(*job);
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&] { return job->done == job->chunks; });
+        auto it = std::find(jobs.begin(), jobs.end(), job);
+        if (it != jobs.end()) jobs.erase(it);
+    }
+};
+
+std::mutex pool_mutex;
+std::unique_ptr<thread_pool> pool;
+
+thread_pool& get_pool() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (!pool) pool = std::make_unique<thread_pool>(runtime_config());
+    return *pool;
+}
+
+}  // namespace
+
+void configure_runtime(const runtime_config& config) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool.reset();
+    pool = std::make_unique<thread_pool>(config);
+    spdlog::info("Runtime configured with {} threads", pool->threads);
+}
+
+std::size_t runtime_threads() { return get_pool().threads; }
+
+std::size_t grain_size(std::size_t cost) {
+    const std::size_t target = 1 << 15;
+    return std::max<std::size_t>(1, target / std::max<std::size_t>(1, cost));
+}
+
+void parallel_for(std::size_t n, std::size_t grain,
+                  const std::function<void(std::size_t, std::size_t)>& f) {
+    if (!n) return;
+    grain = std::max<std::size_t>(1, grain);
+    if (n <= grain || in_kernel) {
+        f(0, n);
+        return;
+    }
+    auto& p = get_pool();
+    if (p.threads == 1) {
+        f(0, n);
+        return;
+    }
+    // A few chunks per thread keep the threads busy when chunks take
+    // different amounts of time.
+    auto job = std::make_shared<job_t>();
+    job->f = &f;
+    job->n = n;
+    job->chunk = std::max(grain, (n + 4 * p.threads - 1) / (4 * p.threads));
+    job->chunks = (n + job->chunk - 1) / job->chunk;
+    p.submit(job);
+}
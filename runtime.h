@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+struct runtime_config {
+    // Total number of threads running kernels, including the calling thread.
+    // 0 means std::thread::hardware_concurrency().
+    std::size_t threads = 0;
+    // Worker i is pinned to cpus[i % cpus.size()]; empty means no pinning.
+    std::vector<int> cpus;
+};
+
+// Replaces the thread pool used by parallel_for. Must not be called while
+// kernels are running.
+void configure_runtime(const runtime_config& config);
+
+std::size_t runtime_threads();
+
+// Number of items worth handing to one thread when each item costs about
+// cost elementary operations.
+std::size_t grain_size(std::size_t cost);
+
+// Calls f(begin, end) on disjoint ranges covering [0, n), each holding at
+// least grain items, and returns when all of them are done. Work of at most
+// one grain, and calls made from inside a kernel, run inline on the calling
+// thread.
+void parallel_for(std::size_t n, std::size_t grain,
+                  const std::function<void(std::size_t, std::size_t)>& f);
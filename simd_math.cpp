@@ -0,0 +1,285 @@
+#include "simd_math.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+static_assert(std::is_same<real, double>::value,
+              "simd_math implements double precision only");
+
+namespace {
+
+// exp: x = k ln2 + r with |r| <= ln2 / 2, ln2 split so that k * ln2_hi is
+// exact, and e^r - 1 from its Taylor series up to r^13, whose truncation
+// error is below 2^-57.
+const double log2e = 1.4426950408889634;
+const double ln2_hi = 6.93147180369123816490e-01;
+const double ln2_lo = 1.90821492927058770002e-10;
+const double exp_coeffs[] = {
+    1.0 / 6227020800, 1.0 / 479001600, 1.0 / 39916800, 1.0 / 3628800,
+    1.0 / 362880,     1.0 / 40320,     1.0 / 5040,     1.0 / 720,
+    1.0 / 120,        1.0 / 24,        1.0 / 6,        1.0 / 2};
+
+// log: x = 2^e m with m in [sqrt(2) / 2, sqrt(2)], f = (m - 1) / (m + 1) and
+// log(m) = 2 atanh(f) from its series up to f^23, |f| <= 0.172.
+const double sqrt2 = 1.4142135623730951;
+const double log_coeffs[] = {1.0 / 23, 1.0 / 21, 1.0 / 19, 1.0 / 17,
+                             1.0 / 15, 1.0 / 13, 1.0 / 11, 1.0 / 9,
+                             1.0 / 7,  1.0 / 5,  1.0 / 3};
+
+// Beyond these, exp overflows or underflows and tanh rounds to +-1.
+const double exp_min = -746, exp_max = 710, tanh_max = 20;
+
+double from_bits(std::uint64_t b) {
+    double d;
+    std::memcpy(&d, &b, sizeof(d));
+    return d;
+}
+
+std::uint64_t to_bits(double d) {
+    std::uint64_t b;
+    std::memcpy(&b, &d, sizeof(b));
+    return b;
+}
+
+// 2^k for integral k in [-1022, 1023].
+double pow2(double k) { return from_bits((std::uint64_t)(k + 1023) << 52); }
+
+double expm1_poly(double r) {
+    double q = exp_coeffs[0];
+    for (std::size_t i = 1; i < std::size(exp_coeffs); i++)
+        q = q * r + exp_coeffs[i];
+    return r + r * r * q;
+}
+
+double exp_scalar(double x) {
+    if (std::isnan(x)) return x;
+    x = std::clamp(x, exp_min, exp_max);
+    auto k = std::nearbyint(x * log2e);
+    auto r = (x - k * ln2_hi) - k * ln2_lo;
+    auto k1 = std::floor(k / 2);
+    return (1 + expm1_poly(r)) * pow2(k1) * pow2(k - k1);
+}
+
+// For |x| <= tanh_max * 2 only.
+double expm1_scalar(double x) {
+    auto k = std::nearbyint(x * log2e);
+    auto r = (x - k * ln2_hi) - k * ln2_lo;
+    auto t = pow2(k);
+    return t * expm1_poly(r) + (t - 1);
+}
+
+double log_scalar(double x) {
+    if (std::isnan(x)) return x;
+    if (x < 0) return std::numeric_limits<double>::quiet_NaN();
+    if (x == 0) return -std::numeric_limits<double>::infinity();
+    if (std::isinf(x)) return x;
+    double e = -1023;
+    if (x < DBL_MIN) {
+        x *= 0x1p52;
+        e -= 52;
+    }
+    auto bits = to_bits(x);
+    e += bits >> 52;
+    auto m = from_bits((bits & ((1ull << 52) - 1)) | (1023ull << 52));
+    if (m > sqrt2) {
+        m *= 0.5;
+        e += 1;
+    }
+    auto f = (m - 1) / (m + 1), s = f * f;
+    double q = log_coeffs[0];
+    for (std::size_t i = 1; i < std::size(log_coeffs); i++)
+        q = q * s + log_coeffs[i];
+    auto two_f = f + f;
+    return e * ln2_hi + (two_f + (two_f * s * q + e * ln2_lo));
+}
+
+double tanh_scalar(double x) {
+    if (std::isnan(x)) return x;
+    auto t = expm1_scalar(2 * std::min(std::abs(x), tanh_max));
+    return std::copysign(t / (t + 2), x);
+}
+
+// e^x / (1 + e^x) for negative x, which keeps the tail below e^-709.
+double sigmoid_scalar(double x) {
+    if (std::isnan(x)) return x;
+    auto e = exp_scalar(-std::abs(x));
+    return (x < 0 ? e : 1) / (1 + e);
+}
+
+double gelu_scalar(double x) {
+    if (x == -std::numeric_limits<double>::infinity()) return -0.0;
+    return x * sigmoid_scalar(gelu_c * x * (1 + gelu_a * x * x));
+}
+
+template <double (*f)(double)>
+void scalar_kernel(const real* in, real* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = f(in[i]);
+}
+
+#ifdef __x86_64__
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 __m256d set(double x) { return _mm256_set1_pd(x); }
+
+AVX2 __m256d pow2_4(__m256d k) {
+    // Adding 1.5 * 2^52 puts k + 1023 in the low mantissa bits.
+    auto b = _mm256_castpd_si256(_mm256_add_pd(k, set(0x1.8p52 + 1023)));
+    return _mm256_castsi256_pd(_mm256_slli_epi64(b, 52));
+}
+
+AVX2 __m256d expm1_poly4(__m256d r) {
+    auto q = set(exp_coeffs[0]);
+    for (std::size_t i = 1; i < std::size(exp_coeffs); i++)
+        q = _mm256_fmadd_pd(q, r, set(exp_coeffs[i]));
+    return _mm256_fmadd_pd(_mm256_mul_pd(r, r), q, r);
+}
+
+AVX2 __m256d reduce4(__m256d x, __m256d& k) {
+    k = _mm256_round_pd(_mm256_mul_pd(x, set(log2e)),
+                        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    auto r = _mm256_fnmadd_pd(k, set(ln2_hi), x);
+    return _mm256_fnmadd_pd(k, set(ln2_lo), r);
+}
+
+AVX2 __m256d exp4(__m256d x) {
+    auto nan = _mm256_cmp_pd(x, x, _CMP_UNORD_Q);
+    auto xc = _mm256_min_pd(_mm256_max_pd(x, set(exp_min)), set(exp_max));
+    __m256d k;
+    auto p = expm1_poly4(reduce4(xc, k));
+    auto k1 = _mm256_floor_pd(_mm256_mul_pd(k, set(0.5)));
+    auto y = _mm256_mul_pd(_mm256_add_pd(set(1), p), pow2_4(k1));
+    y = _mm256_mul_pd(y, pow2_4(_mm256_sub_pd(k, k1)));
+    return _mm256_blendv_pd(y, x, nan);
+}
+
+AVX2 __m256d expm1_4(__m256d x) {
+    __m256d k;
+    auto p = expm1_poly4(reduce4(x, k));
+    auto t = pow2_4(k);
+    return _mm256_fmadd_pd(t, p, _mm256_sub_pd(t, set(1)));
+}
+
+AVX2 __m256d log4(__m256d x) {
+    auto tiny = _mm256_cmp_pd(x, set(DBL_MIN), _CMP_LT_OQ);
+    auto xs = _mm256_blendv_pd(x, _mm256_mul_pd(x, set(0x1p52)), tiny);
+    auto bits = _mm256_castpd_si256(xs);
+    // The biased exponent, converted by placing it in the mantissa of 2^52.
+    auto biased = _mm256_castsi256_pd(
+        _mm256_or_si256(_mm256_srli_epi64(bits, 52),
+                        _mm256_castpd_si256(set(0x1p52))));
+    auto e = _mm256_sub_pd(biased, set(0x1p52 + 1023));
+    e = _mm256_sub_pd(e, _mm256_and_pd(tiny, set(52)));
+    auto m = _mm256_castsi256_pd(_mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi64x((1ll << 52) - 1)),
+        _mm256_set1_epi64x(1023ll << 52)));
+    auto big = _mm256_cmp_pd(m, set(sqrt2), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, set(0.5)), big);
+    e = _mm256_add_pd(e, _mm256_and_pd(big, set(1)));
+    auto f = _mm256_div_pd(_mm256_sub_pd(m, set(1)), _mm256_add_pd(m, set(1)));
+    auto s = _mm256_mul_pd(f, f);
+    auto q = set(log_coeffs[0]);
+    for (std::size_t i = 1; i < std::size(log_coeffs); i++)
+        q = _mm256_fmadd_pd(q, s, set(log_coeffs[i]));
+    auto two_f = _mm256_add_pd(f, f);
+    auto t = _mm256_fmadd_pd(_mm256_mul_pd(two_f, s), q,
+                             _mm256_mul_pd(e, set(ln2_lo)));
+    auto y = _mm256_fmadd_pd(e, set(ln2_hi), _mm256_add_pd(two_f, t));
+    const auto inf = std::numeric_limits<double>::infinity();
+    y = _mm256_blendv_pd(y, set(std::numeric_limits<double>::quiet_NaN()),
+                         _mm256_cmp_pd(x, set(0), _CMP_LT_OQ));
+    y = _mm256_blendv_pd(y, set(-inf), _mm256_cmp_pd(x, set(0), _CMP_EQ_OQ));
+    y = _mm256_blendv_pd(y, x, _mm256_cmp_pd(x, set(inf), _CMP_EQ_OQ));
+    return _mm256_blendv_pd(y, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+}
+
+AVX2 __m256d tanh4(__m256d x) {
+    auto sign = _mm256_and_pd(x, set(-0.0));
+    auto a = _mm256_min_pd(_mm256_andnot_pd(set(-0.0), x), set(tanh_max));
+    auto t = expm1_4(_mm256_add_pd(a, a));
+    auto y = _mm256_or_pd(_mm256_div_pd(t, _mm256_add_pd(t, set(2))), sign);
+    return _mm256_blendv_pd(y, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+}
+
+AVX2 __m256d sigmoid4(__m256d x) {
+    auto e = exp4(_mm256_or_pd(x, set(-0.0)));
+    auto num = _mm256_blendv_pd(set(1), e, _mm256_cmp_pd(x, set(0), _CMP_LT_OQ));
+    auto y = _mm256_div_pd(num, _mm256_add_pd(set(1), e));
+    return _mm256_blendv_pd(y, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+}
+
+AVX2 __m256d gelu4(__m256d x) {
+    auto x2 = _mm256_mul_pd(x, x);
+    auto z = _mm256_mul_pd(_mm256_mul_pd(set(gelu_c), x),
+                           _mm256_fmadd_pd(set(gelu_a), x2, set(1)));
+    auto y = _mm256_mul_pd(x, sigmoid4(z));
+    auto minus_inf = set(-std::numeric_limits<double>::infinity());
+    return _mm256_blendv_pd(y, set(-0.0),
+                            _mm256_cmp_pd(x, minus_inf, _CMP_EQ_OQ));
+}
+
+// The tail is padded to a full vector so every element goes through the same
+// code.
+#define AVX2_KERNEL(name, f)                                              \
+    AVX2 void name(const real* in, real* out, std::size_t n) {            \
+        std::size_t i = 0;                                                \
+        for (; i + 4 <= n; i += 4)                                        \
+            _mm256_storeu_pd(out + i, f(_mm256_loadu_pd(in + i)));        \
+        if (i == n) return;                                               \
+        double buffer[4] = {1, 1, 1, 1};                                  \
+        std::copy(in + i, in + n, buffer);                                \
+        _mm256_storeu_pd(buffer, f(_mm256_loadu_pd(buffer)));             \
+        std::copy(buffer, buffer + (n - i), out + i);                     \
+    }
+
+AVX2_KERNEL(exp_avx2, exp4)
+AVX2_KERNEL(log_avx2, log4)
+AVX2_KERNEL(tanh_avx2, tanh4)
+AVX2_KERNEL(sigmoid_avx2, sigmoid4)
+AVX2_KERNEL(gelu_avx2, gelu4)
+#endif
+
+using kernel_t = void (*)(const real*, real*, std::size_t);
+
+struct kernels_t {
+    kernel_t exp, log, tanh, sigmoid, gelu;
+};
+
+kernels_t select_kernels() {
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return {exp_avx2, log_avx2, tanh_avx2, sigmoid_avx2, gelu_avx2};
+#endif
+    return {scalar_kernel<exp_scalar>, scalar_kernel<log_scalar>,
+            scalar_kernel<tanh_scalar>, scalar_kernel<sigmoid_scalar>,
+            scalar_kernel<gelu_scalar>};
+}
+
+const kernels_t kernels = select_kernels();
+
+}  // namespace
+
+void vexp(const real* in, real* out, std::size_t n) { kernels.exp(in, out, n); }
+
+void vlog(const real* in, real* out, std::size_t n) { kernels.log(in, out, n); }
+
+void vtanh(const real* in, real* out, std::size_t n) {
+    kernels.tanh(in, out, n);
+}
+
+void vsigmoid(const real* in, real* out, std::size_t n) {
+    kernels.sigmoid(in, out, n);
+}
+
+void vgelu(const real* in, real* out, std::size_t n) {
+    kernels.gelu(in, out, n);
+}
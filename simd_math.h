@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+
+#include "config.h"
+
+// Element-wise transcendental functions over arrays; out may equal in. The
+// kernels run four lanes at a time with AVX2 and FMA when the CPU has them,
+// chosen once at startup, and fall back to the same algorithms in scalar
+// code otherwise. Away from overflow and underflow, exp is within 1 ULP of
+// the exact result, log within 2 ULP and tanh and sigmoid within 3 ULP.
+void vexp(const real* in, real* out, std::size_t n);
+
+void vlog(const real* in, real* out, std::size_t n);
+
+void vtanh(const real* in, real* out, std::size_t n);
+
+void vsigmoid(const real* in, real* out, std::size_t n);
+
+constexpr real gelu_c = 1.5957691216057308;  // 2 sqrt(2 / pi)
+constexpr real gelu_a = 0.044715;
+
+// x * sigmoid(gelu_c (x + gelu_a x^3)), which equals the usual
+// tanh approximation of GELU without its cancellation for negative x. The
+// rounding of the cubic is magnified by the sigmoid for large negative x.
+void vgelu(const real* in, real* out, std::size_t n);
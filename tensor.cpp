@@ -1,6 +1,7 @@
 #include "tensor.h"
 
 #include "control_flow.h"
+#include "metrics.h"
 
 std::size_t tensor_t::get_offset(const index_t& index) const {
     std::size_t offset = 0;
@@ -32,11 +33,17 @@ std::size_t shape_to_size(const shape_t& shape) {
     return size;
 }
 
-tensor_t new_tensor(const shape_t& shape) {
+tensor_t new_tensor(const shape_t& shape, buffer_kind kind) {
     real* data = new real[shape_to_size(shape)];
+    metrics().allocate(kind, shape_to_size(shape) * sizeof(real));
     tensor_t tensor;
     tensor.data = data;
     tensor.shape = shape;
     tensor.offsets = shape_to_offsets(shape);
     return tensor;
 }
+
+void delete_tensor(tensor_t tensor, buffer_kind kind) {
+    metrics().release(kind, shape_to_size(tensor.shape) * sizeof(real));
+    delete[] tensor.data;
+}
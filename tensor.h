@@ -21,4 +21,10 @@ offsets_t shape_to_offsets(shape_t shape);
 
 std::size_t shape_to_size(const shape_t& shape);
 
-tensor_t new_tensor(const shape_t& shape);
+// What a tensor is used for, for memory accounting.
+enum class buffer_kind { value, adjoint, acc, optimizer_state, other };
+
+tensor_t new_tensor(const shape_t& shape,
+                    buffer_kind kind = buffer_kind::other);
+
+void delete_tensor(tensor_t tensor, buffer_kind kind = buffer_kind::other);
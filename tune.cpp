@@ -0,0 +1,306 @@
+#include "tune.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <typeinfo>
+
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+#include "control_flow.h"
+#include "runtime.h"
+
+static std::string cpu_model() {
+    std::ifstream st("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(st, line)) {
+        if (line.rfind("model name", 0)) continue;
+        auto colon = line.find(':');
+        if (colon == std::string::npos) break;
+        return line.substr(line.find_first_not_of(' ', colon + 1));
+    }
+    return "unknown";
+}
+
+tuning_cache_t::tuning_cache_t(const std::string& path_) : path(path_) {
+    std::ifstream st(path);
+    std::string line;
+    while (std::getline(st, line)) {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos) continue;
+        std::istringstream rest(line.substr(tab + 1));
+        int order;
+        std::size_t grain;
+        if (!(rest >> order >> grain) || order < (int)loop_order::automatic ||
+            order > (int)loop_order::rows) {
+            spdlog::warn("Ignoring malformed entry in tuning cache {}: {}",
+                         path, line);
+            continue;
+        }
+        entries[line.substr(0, tab)] = {(loop_order)order, grain};
+    }
+}
+
+void tuning_cache_t::save() const {
+    std::ofstream st(path);
+    if (!st) PANIC("Cannot write tuning cache {}", path);
+    for (const auto& [key, choice] : entries)
+        st << key << "\t" << (int)choice.first << " " << choice.second << "\n";
+}
+
+static std::string shape_string(const shape_t& shape) {
+    std::string ret;
+    for (auto s : shape) ret += (ret.empty() ? "" : "x") + std::to_string(s);
+    return ret;
+}
+
+static std::string type_name(const node_t* u) {
+    std::string ret = typeid(*u).name();
+#ifdef __GNUG__
+    int status;
+    auto demangled = abi::__cxa_demangle(ret.c_str(), nullptr, nullptr, &status);
+    if (!status) ret = demangled;
+    free(demangled);
+#endif
+    return ret;
+}
+
+static std::string key(const std::string& cpu, std::size_t threads,
+                       const node_t* u) {
+    std::string ret =
+        cpu + " " + std::to_string(threads) + "t " + type_name(u);
+    for (auto d : u->dependencies)
+        ret += " " + shape_string(u->graph->nodes[d]->value.shape);
+    ret += " -> " + shape_string(u->value.shape);
+    if (auto p = dynamic_cast<const multiplication*>(u))
+        ret += std::string(" ") + (p->transpose_a ? "T" : "N") +
+               (p->transpose_b ? "T" : "N");
+    return ret;
+}
+
+// Best of several runs of run, in seconds. reset is called before every run,
+// outside the timing.
+template <class F, class G>
+static double benchmark(F run, G reset) {
+    reset();
+    run();
+    double best = std::numeric_limits<double>::infinity(), total = 0;
+    for (int rep = 0; rep < 20 && (rep < 3 || total < 0.05); rep++) {
+        reset();
+        auto start = std::chrono::steady_clock::now();
+        run();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+        total += elapsed.count();
+    }
+    return best;
+}
+
+// Fills the values of the dependencies of u with random numbers. In the
+// sparse case only every fourth row of op(b) of a multiplication is nonzero,
+// as for the pixels of an image or a one-hot label. Embedding ids must stay
+// valid row numbers.
+static void fill_inputs(node_t* u, bool sparsep) {
+    auto g = u->graph;
+    auto p = dynamic_cast<multiplication*>(u);
+    auto embeddingp = dynamic_cast<embedding_node*>(u) != nullptr;
+    for (std::size_t k = 0; k < u->dependencies.size(); k++) {
+        auto& v = g->nodes[u->dependencies[k]]->value;
+        auto size = shape_to_size(v.shape);
+        for (std::size_t i = 0; i < size; i++) {
+            v.data[i] = 0.5 + g->uniform_dist(g->rng);
+            if (embeddingp && k == 1) v.data[i] = 0;
+            if (sparsep && k == 1) {
+                auto row = p->transpose_b ? i % v.shape[1] : i / v.shape[1];
+                if (row % 4) v.data[i] = 0;
+            }
+        }
+    }
+}
+
+// Whether the first size elements of data match expected up to rounding.
+static bool matches(const std::vector<real>& expected, const real* data) {
+    real scale = 0;
+    for (auto x : expected) scale = std::max(scale, std::abs(x));
+    for (std::size_t i = 0; i < expected.size(); i++)
+        if (!(std::abs(data[i] - expected[i]) <= 1e-9 * (1 + scale)))
+            return false;
+    return true;
+}
+
+void autotune(graph_t* g, const std::string& path) {
+    tuning_cache_t cache(path);
+    auto cpu = cpu_model();
+    auto threads = runtime_threads();
+    const input_t input;
+    auto& ctx = *g->context;
+    std::size_t tuned = 0, cached = 0;
+    for (auto u : g->nodes) {
+        // Placeholders and parameters have no kernels.
+        if (u->dependencies.empty()) continue;
+        auto p = dynamic_cast<multiplication*>(u);
+        auto embeddingp = dynamic_cast<embedding_node*>(u) != nullptr;
+        // Graphs without gradient buffers are never differentiated.
+        auto backwardp = u->adjoint.data != nullptr;
+        auto set = [&](bool sparsep, bool backward,
+                       std::pair<loop_order, std::size_t> choice) {
+            if (p) {
+                auto& kernel = sparsep ? p->sparse_kernel : p->dense_kernel;
+                if (backward) {
+                    kernel.backward_grain = choice.second;
+                } else {
+                    kernel.order = choice.first;
+                    kernel.grain = choice.second;
+                }
+            } else if (backward) {
+                u->backward_grain = choice.second;
+            } else {
+                u->grain = choice.second;
+            }
+        };
+        // Multiplications switch kernels on the sparsity of op(b), so both
+        // cases are tuned on inputs of their own.
+        std::vector<bool> cases{false};
+        if (p) cases.push_back(true);
+        std::vector<std::string> keys;
+        auto missing = false;
+        for (auto sparsep : cases) {
+            auto k = key(cpu, threads, u) + (sparsep ? " sparse" : "");
+            keys.push_back(k);
+            auto forward = cache.entries.find(k);
+            auto backward = cache.entries.find(k + " backward");
+            if (forward == cache.entries.end() ||
+                (backwardp && backward == cache.entries.end())) {
+                missing = true;
+                continue;
+            }
+            set(sparsep, false, forward->second);
+            if (backwardp) set(sparsep, true, backward->second);
+        }
+        if (!missing) {
+            cached++;
+            continue;
+        }
+        // Benchmark on random inputs, restoring the real values and
+        // adjoints afterwards.
+        std::vector<tensor_t*> touched{&u->value};
+        if (backwardp) touched.push_back(&u->adjoint);
+        for (auto d : u->dependencies) {
+            touched.push_back(&g->nodes[d]->value);
+            if (backwardp) touched.push_back(&g->nodes[d]->adjoint);
+        }
+        std::vector<std::vector<real>> saved;
+        for (auto t : touched)
+            saved.emplace_back(t->data, t->data + shape_to_size(t->shape));
+        // The adjoints of the dependencies, which the backward kernel adds
+        // to.
+        auto gradients = [&] {
+            std::vector<real> ret;
+            for (auto d : u->dependencies) {
+                auto& a = g->nodes[d]->adjoint;
+                ret.insert(ret.end(), a.data, a.data + shape_to_size(a.shape));
+            }
+            return ret;
+        };
+        auto clear_gradients = [&] {
+            for (auto d : u->dependencies) {
+                auto& a = g->nodes[d]->adjoint;
+                std::fill(a.data, a.data + shape_to_size(a.shape), 0);
+            }
+        };
+        auto size = shape_to_size(u->value.shape);
+        // Items are rows of the result for multiplications, columns for the
+        // backward kernel of embeddings and elements otherwise.
+        auto grains = [&](std::size_t items) {
+            return std::vector<std::size_t>{
+                0, std::numeric_limits<std::size_t>::max(),
+                (items + threads - 1) / threads,
+                (items + 4 * threads - 1) / (4 * threads)};
+        };
+        for (std::size_t c = 0; c < cases.size(); c++) {
+            auto sparsep = cases[c];
+            fill_inputs(u, sparsep);
+            // Every candidate must reproduce the result of the default
+            // kernel.
+            set(sparsep, false, {loop_order::automatic, 0});
+            set(sparsep, true, {loop_order::automatic, 0});
+            u->compute(input, ctx);
+            if (p && ctx.state<multiplication::state_t>(u->index).sparsep !=
+                         sparsep) {
+                // The threshold keeps this case from being taken.
+                cache.entries[keys[c]] = {loop_order::automatic, 0};
+                if (backwardp)
+                    cache.entries[keys[c] + " backward"] = {
+                        loop_order::automatic, 0};
+                continue;
+            }
+            std::vector<real> expected(u->value.data, u->value.data + size);
+            std::vector<loop_order> orders{loop_order::automatic};
+            if (p) orders = {loop_order::dot, loop_order::rows};
+            std::pair<loop_order, std::size_t> best{loop_order::automatic, 0};
+            double best_time = std::numeric_limits<double>::infinity();
+            for (auto order : orders) {
+                for (auto grain : grains(p ? u->value.shape[0] : size)) {
+                    set(sparsep, false, {order, grain});
+                    auto time = benchmark([&] { u->compute(input, ctx); },
+                                          [] {});
+                    if (!matches(expected, u->value.data)) {
+                        spdlog::warn("Rejecting kernel variant {} {} of node "
+                                     "{}, which computes a wrong result",
+                                     (int)order, grain, u->name);
+                        continue;
+                    }
+                    if (time < best_time) {
+                        best_time = time;
+                        best = {order, grain};
+                    }
+                }
+            }
+            set(sparsep, false, best);
+            cache.entries[keys[c]] = best;
+            if (!backwardp) continue;
+            // The backward kernel runs after this forward pass, with a
+            // random adjoint.
+            u->compute(input, ctx);
+            for (std::size_t i = 0; i < size; i++)
+                u->adjoint.data[i] = 0.5 + g->uniform_dist(g->rng);
+            clear_gradients();
+            u->differentiate();
+            auto expected_gradients = gradients();
+            std::size_t best_grain = 0;
+            best_time = std::numeric_limits<double>::infinity();
+            auto items = embeddingp ? u->value.shape[1]
+                                    : p ? u->value.shape[0] : size;
+            for (auto grain : grains(items)) {
+                set(sparsep, true, {loop_order::automatic, grain});
+                auto time = benchmark([&] { u->differentiate(); },
+                                      clear_gradients);
+                if (!matches(expected_gradients, gradients().data())) {
+                    spdlog::warn("Rejecting backward grain {} of node {}, "
+                                 "which computes a wrong result",
+                                 grain, u->name);
+                    continue;
+                }
+                if (time < best_time) {
+                    best_time = time;
+                    best_grain = grain;
+                }
+            }
+            set(sparsep, true, {loop_order::automatic, best_grain});
+            cache.entries[keys[c] + " backward"] = {loop_order::automatic,
+                                                    best_grain};
+        }
+        for (std::size_t i = 0; i < touched.size(); i++)
+            std::copy(saved[i].begin(), saved[i].end(), touched[i]->data);
+        tuned++;
+    }
+    if (tuned) cache.save();
+    spdlog::info("Autotuned {} nodes, {} taken from {}", tuned, cached, path);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "graph.h"
+
+// Kernel choices keyed by CPU model, thread count, node type and shapes,
+// with "sparse" appended for the sparse case of a multiplication and
+// "backward" for the grain of the backward kernel, stored one per line as
+// "key<TAB>loop_order grain".
+struct tuning_cache_t {
+    std::string path;
+    std::map<std::string, std::pair<loop_order, std::size_t>> entries;
+    tuning_cache_t(const std::string& path_);
+    void save() const;
+};
+
+// Sets the loop order, grain and backward grain of every computed node of g
+// to the fastest of a few variants, benchmarked on the node's shapes with
+// random inputs, or to the choice already in the cache at path.
+// Multiplications are tuned separately on dense inputs and on inputs that
+// take their sparse path. Variants whose results differ from the default
+// kernel's are rejected. The values and adjoints of the nodes are left
+// unchanged.
+void autotune(graph_t* g, const std::string& path);